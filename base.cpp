@@ -11,14 +11,55 @@
 
 #include "base.h"
 
+static void thread_attr_init(pthread_attr_t *attr, const cpu_set_t *cpus,
+                             int fifo_prio) {
+  struct sched_param  param;
+  int                 ret;
+
+  pthread_attr_init(attr);
+
+  if (cpus &&
+      (ret = pthread_attr_setaffinity_np(attr, sizeof(*cpus), cpus)) != 0)
+    fprintf(stderr, "Can't set thread affinity: %s\n", strerror(ret));
+
+  if (fifo_prio > 0) {
+    param.sched_priority = fifo_prio;
+    pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(attr, SCHED_FIFO);
+    pthread_attr_setschedparam(attr, &param);
+  }
+}
+
+/*
+ * The thread starts on its cpus and with its policy already, nothing it
+ * allocates is touched elsewhere first. Without the privilege for
+ * SCHED_FIFO, or without a usable cpu in the set, it starts without.
+ */
 void BaseThread::create() {
   pthread_attr_t  attr;
   int             ret;
 
-  pthread_attr_init(&attr);
+  thread_attr_init(&attr, get_affinity(), _fifo_prio);
+  ret = pthread_create(&_thread_id, &attr, thread_func, (void *)this);
+  pthread_attr_destroy(&attr);
+
+  if (ret == EPERM && _fifo_prio > 0) {
+    fprintf(stderr, "Can't use SCHED_FIFO: %s\n", strerror(ret));
+    _fifo_prio = 0;
+    thread_attr_init(&attr, get_affinity(), 0);
+    ret = pthread_create(&_thread_id, &attr, thread_func, (void *)this);
+    pthread_attr_destroy(&attr);
+  }
+
+  if (ret == EINVAL && _pinned) {
+    fprintf(stderr, "Can't pin thread: %s\n", strerror(ret));
+    _pinned = false;
+    thread_attr_init(&attr, NULL, _fifo_prio);
+    ret = pthread_create(&_thread_id, &attr, thread_func, (void *)this);
+    pthread_attr_destroy(&attr);
+  }
 
-  if ((ret = pthread_create(&_thread_id, &attr,
-                            thread_func, (void *)this)) != 0) {
+  if (ret != 0) {
     fprintf(stderr, "Can't create thread: %s\n", strerror(ret));
     exit(1);
   }
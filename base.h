@@ -7,16 +7,33 @@
 #define __BASE_INCLUDE__
 
 #include <pthread.h>
+#include <sched.h>
 
 class BaseThread {
 
 public:
-  BaseThread() {
+  BaseThread() : _pinned(false), _fifo_prio(0) {
+    CPU_ZERO(&_cpus);
   }
 
   virtual ~BaseThread() {
   }
 
+  /* placement of the thread, set before create() */
+  void set_affinity(const cpu_set_t *cpus) {
+    _cpus = *cpus;
+    _pinned = true;
+  }
+
+  void set_sched_fifo(int prio) {
+    _fifo_prio = prio;
+  }
+
+  /* NULL unless the thread is pinned */
+  const cpu_set_t *get_affinity() {
+    return _pinned ? &_cpus : NULL;
+  }
+
   void create();
   
   int wait() {
@@ -37,6 +54,9 @@ protected:
 
 private:
   pthread_t _thread_id;
+  cpu_set_t _cpus;
+  bool      _pinned;
+  int       _fifo_prio;  /* SCHED_FIFO priority, 0 for the default policy */
 };
 
 class ThreadCond {
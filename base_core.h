@@ -10,6 +10,7 @@
 #include "base_server.h"
 #include "connection.h"
 #include "thread.h"
+#include "pubsub.h"
 #include "log.h"
 #include "util.h"
 #include "setup.h"
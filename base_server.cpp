@@ -6,17 +6,24 @@
  */
 
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <netinet/tcp.h>
+#include <linux/filter.h>
 #include <errno.h>
 #include <time.h>
+#include <limits.h>
 
 #include "base.h"
 #include "base_server.h"
+#include "util.h"
 #include "connection.h"
 #include "setup.h"
 #include "log.h"
 #include "thread.h"
+#include "uring.h"
+#include "udp.h"
 
 struct event_base *main_base;
 struct base_conf_t base_conf;
@@ -25,19 +32,63 @@ static conn *listen_conn;
 static volatile bool listen_disable = false;
 
 volatile rel_time_t current_time;
+volatile uint64_t   current_msec;
+volatile uint64_t   current_usec;
 static struct event clockevent;
 static void (*clock_callback)(rel_time_t);
 
+/*
+ * The clocks are written by the main thread only, every ClockTick ms
+ * (once a second by default, see base_conf_init).
+ * current_time starts at the wall clock and then follows CLOCK_MONOTONIC,
+ * a wall clock step does not move it. The date strings change once a
+ * second, into the slot readers don't look at, then the slot flips.
+ */
+static time_t          clock_started;
+static uint64_t        clock_started_usec;
+static time_t          dates_sec;
+static int             dates_slot;
+static char            http_dates[2][sizeof("Sun, 06 Nov 1994 08:49:37 GMT")];
+static char            log_dates[2][sizeof("2011-08-20 12:00:00")];
+
+static void set_current_dates(time_t now) {
+  struct tm tm;
+  int       slot = dates_slot ^ 1;
+
+  gmtime_r(&now, &tm);
+  strftime(http_dates[slot], sizeof(http_dates[slot]),
+           "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  localtime_r(&now, &tm);
+  strftime(log_dates[slot], sizeof(log_dates[slot]),
+           "%Y-%m-%d %H:%M:%S", &tm);
+
+  __atomic_store_n(&dates_slot, slot, __ATOMIC_RELEASE);
+  dates_sec = now;
+}
+
 static void set_current_time(void) {
-  struct timeval timer;
+  struct timespec ts;
+  uint64_t        usec = Util::MonoUsec();
+
+  if (!clock_started) {
+    clock_started = time(NULL);
+    clock_started_usec = usec;
+  }
+
+  current_usec = usec;
+  current_msec = usec / 1000;
+  current_time = (rel_time_t)(clock_started +
+                              (usec - clock_started_usec) / 1000000);
 
-  gettimeofday(&timer, NULL);
-  current_time = (rel_time_t)timer.tv_sec;
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  if (ts.tv_sec != dates_sec)
+    set_current_dates(ts.tv_sec);
 }
 
 static void clock_handler(const int fd, const short which, void *arg) {
   struct timeval t;
   static bool initialized = false;
+  rel_time_t  last = current_time;
   
   if (initialized) {
     /* only delete the event if it's actually there. */
@@ -46,17 +97,31 @@ static void clock_handler(const int fd, const short which, void *arg) {
     initialized = true;
   }
 
-  t.tv_sec = 1;
-  t.tv_usec = 0;
+  t.tv_sec = base_conf.clock_tick / 1000;
+  t.tv_usec = (base_conf.clock_tick % 1000) * 1000;
   evtimer_set(&clockevent, clock_handler, 0);
   event_base_set(main_base, &clockevent);
   evtimer_add(&clockevent, &t);
 
   set_current_time();
-  if (clock_callback)
+  if (current_time != last) {
+    thread_update_load();
+    thread_rebalance();
+  }
+  if (clock_callback && (current_time != last || which == 0))
     clock_callback(current_time);
 }
 
+/* "Sun, 06 Nov 1994 08:49:37 GMT", good for a second after the call */
+const char *current_http_date() {
+  return http_dates[__atomic_load_n(&dates_slot, __ATOMIC_ACQUIRE)];
+}
+
+/* "2011-08-20 12:00:00" in local time, like Util::GetDate() */
+const char *current_log_date() {
+  return log_dates[__atomic_load_n(&dates_slot, __ATOMIC_ACQUIRE)];
+}
+
 static int new_socket(struct addrinfo *ai) {
   int sfd;
   int flags;
@@ -74,6 +139,62 @@ static int new_socket(struct addrinfo *ai) {
   return sfd;
 }
 
+static int set_reuseport(int sfd, int index) {
+  int flags = 1;
+  int error;
+
+  error = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags,
+                     sizeof(flags));
+  if (error != 0) {
+    perror("setsockopt SO_REUSEPORT");
+    return -1;
+  }
+
+#ifdef SO_INCOMING_CPU
+  if (base_conf.reuseport_steering == STEER_INCOMING_CPU) {
+    int cpu = index;
+
+    /* a pinned worker prefers the first cpu it runs on */
+    if (base_conf.nworker_cpus) {
+      const cpu_set_t *cpus = &base_conf.worker_cpus[index % base_conf.nworker_cpus];
+      for (cpu = 0; cpu < CPU_SETSIZE && !CPU_ISSET(cpu, cpus); cpu++)
+        ;
+    }
+
+    error = setsockopt(sfd, SOL_SOCKET, SO_INCOMING_CPU, (void *)&cpu,
+                       sizeof(cpu));
+    if (error != 0)
+      perror("setsockopt SO_INCOMING_CPU");
+  }
+#endif
+
+  return 0;
+}
+
+/*
+ * The program is shared by the whole reuseport group, so it only has to be
+ * attached once; it returns the index of the socket inside the group, and
+ * the sockets join the group in worker order.
+ */
+static void attach_reuseport_cbpf(int sfd) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+  struct sock_filter code[] = {
+    { BPF_LD  | BPF_W | BPF_ABS, 0, 0, (__u32)(SKF_AD_OFF + SKF_AD_CPU) },
+    { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (__u32)base_conf.nthreads },
+    { BPF_RET | BPF_A, 0, 0, 0 },
+  };
+  struct sock_fprog prog;
+
+  prog.len = sizeof(code) / sizeof(code[0]);
+  prog.filter = code;
+
+  if (setsockopt(sfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, (void *)&prog,
+                 sizeof(prog)) != 0) {
+    perror("setsockopt SO_ATTACH_REUSEPORT_CBPF");
+  }
+#endif
+}
+
 int server_socket(const char *interface, int port, int backlog) {
   int sfd;
   struct linger ling;
@@ -84,6 +205,7 @@ int server_socket(const char *interface, int port, int backlog) {
   int error;
   int success = 0;
   int flags = 1;
+  int nlisteners;
 
   ling.l_onoff = 0;
   ling.l_linger = 0;
@@ -95,6 +217,12 @@ int server_socket(const char *interface, int port, int backlog) {
   if (port == -1) {
     port = 0;
   }
+
+  /*
+   * In reuseport mode every worker owns a listener of its own and accepts
+   * on its own base, so connections never cross the dispatch thread.
+   */
+  nlisteners = base_conf.reuseport ? base_conf.nthreads : 1;
   
   snprintf(port_buf, sizeof(port_buf), "%d", port);
   error= getaddrinfo(interface, port_buf, &hints, &ai);
@@ -107,66 +235,239 @@ int server_socket(const char *interface, int port, int backlog) {
   }
   
   for (next= ai; next; next= next->ai_next) {
-    conn *listen_conn_add;
-    if ((sfd = new_socket(next)) == -1) {
-      close(sfd);
-      freeaddrinfo(ai);
-      return 1; 
-    }
+    for (int i = 0; i < nlisteners; i++) {
+      conn *listen_conn_add;
+      LibeventThread *thread = base_conf.reuseport ?
+          get_worker_thread(i) : get_main_thread();
+
+      if ((sfd = new_socket(next)) == -1) {
+        close(sfd);
+        freeaddrinfo(ai);
+        return 1; 
+      }
 
 #ifdef IPV6_V6ONLY
-    if (next->ai_family == AF_INET6) {
-      error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY,
-                         (char *) &flags, sizeof(flags));
-      if (error != 0) {
+      if (next->ai_family == AF_INET6) {
+        error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY,
+                           (char *) &flags, sizeof(flags));
+        if (error != 0) {
+          perror("setsockopt");
+          close(sfd);
+          /*
+           * The address is skipped as a whole: with a socket per worker
+           * the reuseport group has to match the worker index.
+           */
+          if (i == 0)
+            break;
+          freeaddrinfo(ai);
+          return 1;
+        }
+      }
+#endif
+
+      setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+
+      if (base_conf.reuseport && set_reuseport(sfd, i) != 0) {
+        close(sfd);
+        freeaddrinfo(ai);
+        return 1;
+      }
+
+      error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags,
+                         sizeof(flags));
+      if (error != 0)
         perror("setsockopt");
+
+      error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+      if (error != 0)
+        perror("setsockopt");
+
+      error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags,
+                         sizeof(flags));
+      if (error != 0)
+        perror("setsockopt");
+
+      if (bind(sfd, next->ai_addr, next->ai_addrlen) == -1) {
+        perror("bind()");
         close(sfd);
-        continue;
+        freeaddrinfo(ai);
+        return 1;
+      } else {
+        success++;
+        if (listen(sfd, backlog) == -1) {
+          perror("listen()");
+          close(sfd);
+          freeaddrinfo(ai);
+          return 1;
+        }
       }
+
+      if (base_conf.reuseport && i == 0 &&
+          base_conf.reuseport_steering == STEER_CBPF) {
+        attach_reuseport_cbpf(sfd);
+      }
+
+      if (!(listen_conn_add = conn_new(sfd, conn_listening,
+                                       EV_READ | EV_PERSIST, thread))) {
+        fprintf(stderr, "failed to create listening connection\n");
+        exit(EXIT_FAILURE);
+      }
+      
+      conn_set_peer(listen_conn_add, next->ai_addr, next->ai_addrlen);
+      listen_conn_add->next = listen_conn;
+      listen_conn = listen_conn_add;
     }
-#endif
+  }
 
-    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+  freeaddrinfo(ai);
+  return success == 0;
+}
 
-    error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags,
-                       sizeof(flags));
-    if (error != 0)
-      perror("setsockopt");
+/*
+ * Unix domain stream listener for clients on the same host, served by the
+ * dispatch thread like a TCP one. A path starting with '@' names a socket
+ * in the abstract namespace; a socket file left over at path is removed
+ * first, the new one gets access_mask (e.g. 0700) as its mode.
+ */
+int server_socket_unix(const char *path, int access_mask, int backlog) {
+  struct sockaddr_un addr;
+  struct stat        st;
+  socklen_t          len;
+  size_t             plen = strlen(path);
+  mode_t             old_umask;
+  conn              *listen_conn_add;
+  int                sfd;
+
+  if (plen == 0 || plen >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Bad unix socket path '%s'\n", path);
+    return 1;
+  }
 
-    error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
-    if (error != 0)
-      perror("setsockopt");
+  if ((sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+    perror("socket()");
+    return 1;
+  }
 
-    error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags,
-                       sizeof(flags));
-    if (error != 0)
-      perror("setsockopt");
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path, plen);
+  len = offsetof(struct sockaddr_un, sun_path) + plen;
 
-    if (bind(sfd, next->ai_addr, next->ai_addrlen) == -1) {
-      perror("bind()");
-      close(sfd);
-      freeaddrinfo(ai);
-      return 1;
-    } else {
-      success++;
-      if (listen(sfd, backlog) == -1) {
-        perror("listen()");
+  if (path[0] == '@') {
+    addr.sun_path[0] = '\0';
+  } else {
+    len++;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(path);
+  }
+
+  old_umask = umask(~access_mask & 0777);
+  if (bind(sfd, (struct sockaddr *)&addr, len) == -1) {
+    perror("bind()");
+    umask(old_umask);
+    close(sfd);
+    return 1;
+  }
+  umask(old_umask);
+
+  if (listen(sfd, backlog) == -1) {
+    perror("listen()");
+    close(sfd);
+    return 1;
+  }
+
+  if (!(listen_conn_add = conn_new(sfd, conn_listening,
+                                   EV_READ | EV_PERSIST, get_main_thread()))) {
+    fprintf(stderr, "failed to create listening connection\n");
+    exit(EXIT_FAILURE);
+  }
+
+  conn_set_peer(listen_conn_add, (struct sockaddr *)&addr, len);
+  listen_conn_add->next = listen_conn;
+  listen_conn = listen_conn_add;
+  return 0;
+}
+
+/*
+ * UDP request/response on port: every worker binds a datagram socket of
+ * its own into one SO_REUSEPORT group (steered like ListenReusePort
+ * listeners) and serves it on its base, see udp.h for the framing.
+ */
+int server_socket_udp(const char *interface, int port) {
+  int sfd;
+  struct addrinfo *ai;
+  struct addrinfo *next;
+  struct addrinfo hints;
+  char port_buf[NI_MAXSERV];
+  int error;
+  int success = 0;
+  int flags = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = AI_PASSIVE;
+  hints.ai_family = base_conf.support_ipv6 ? AF_UNSPEC : AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  snprintf(port_buf, sizeof(port_buf), "%d", port);
+  error= getaddrinfo(interface, port_buf, &hints, &ai);
+  if (error != 0) {
+    if (error != EAI_SYSTEM)
+      fprintf(stderr, "getaddrinfo(): %s\n", gai_strerror(error));
+    else
+      perror("getaddrinfo()");
+    return 1;
+  }
+
+  for (next= ai; next; next= next->ai_next) {
+    for (int i = 0; i < base_conf.nthreads; i++) {
+      conn *udp_conn;
+
+      if ((sfd = new_socket(next)) == -1) {
+        freeaddrinfo(ai);
+        return 1;
+      }
+
+#ifdef IPV6_V6ONLY
+      if (next->ai_family == AF_INET6) {
+        error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY,
+                           (char *) &flags, sizeof(flags));
+        if (error != 0) {
+          perror("setsockopt");
+          close(sfd);
+          /* skip the address as a whole, see server_socket */
+          if (i == 0)
+            break;
+          freeaddrinfo(ai);
+          return 1;
+        }
+      }
+#endif
+
+      if (set_reuseport(sfd, i) != 0) {
         close(sfd);
         freeaddrinfo(ai);
         return 1;
       }
-    }
 
-    if (!(listen_conn_add = conn_new(sfd, conn_listening,
-                                     EV_READ | EV_PERSIST, get_main_thread()))) {
-      fprintf(stderr, "failed to create listening connection\n");
-      exit(EXIT_FAILURE);
+      if (bind(sfd, next->ai_addr, next->ai_addrlen) == -1) {
+        perror("bind()");
+        close(sfd);
+        freeaddrinfo(ai);
+        return 1;
+      }
+      success++;
+
+      if (i == 0 && base_conf.reuseport_steering == STEER_CBPF)
+        attach_reuseport_cbpf(sfd);
+
+      if (!(udp_conn = conn_new(sfd, conn_datagram, EV_READ | EV_PERSIST,
+                                get_worker_thread(i)))) {
+        fprintf(stderr, "failed to create udp connection\n");
+        exit(EXIT_FAILURE);
+      }
+
+      conn_set_peer(udp_conn, next->ai_addr, next->ai_addrlen);
     }
-    
-    listen_conn_add->host->assign(interface?interface:"0.0.0.0");
-    listen_conn_add->port = port;
-    listen_conn_add->next = listen_conn;
-    listen_conn = listen_conn_add;
   }
 
   freeaddrinfo(ai);
@@ -198,6 +499,7 @@ void do_accept_new_conns(bool do_accept) {
 
 void base_server_init(const Setup *setup) {
   base_conf_init(setup);
+  set_current_time();
   /*cout << "event method: " << event_base_get_method(main_base) << endl;*/
   evthread_use_pthreads();
   thread_init();
@@ -227,10 +529,273 @@ void set_clock_callback(void (*cb)(rel_time_t), void (**old_cb)(rel_time_t)) {
   clock_callback = cb;
 }
 
+static bool cpu_sets_add(cpu_set_t **sets, int *n, const cpu_set_t *set) {
+  cpu_set_t *grown = (cpu_set_t *)realloc(*sets, (*n + 1) * sizeof(cpu_set_t));
+
+  if (!grown)
+    return false;
+  grown[(*n)++] = *set;
+  *sets = grown;
+  return true;
+}
+
+/*
+ * CPU lists like "0-3,8". Every cpu makes a set of its own, unless the
+ * list is split in groups with ';' ("0-1;2-3"), or single is set: then a
+ * group, or the whole list, makes a set. Returns the number of sets,
+ * 0 for an empty list and -1 for a bad one.
+ */
+static int parse_cpu_list(const char *list, bool single, cpu_set_t **sets) {
+  bool       grouped = single || strchr(list, ';') != NULL;
+  const char *p = list;
+  char      *end;
+  cpu_set_t  cur;
+  int        n = 0;
+  long       a, b;
+
+  *sets = NULL;
+  CPU_ZERO(&cur);
+
+  while (*p) {
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (!*p)
+      break;
+
+    a = b = strtol(p, &end, 10);
+    if (end == p || a < 0)
+      goto bad;
+    p = end;
+    if (*p == '-') {
+      b = strtol(p + 1, &end, 10);
+      if (end == p + 1 || b < a)
+        goto bad;
+      p = end;
+    }
+    if (b >= CPU_SETSIZE)
+      goto bad;
+
+    for (long i = a; i <= b; i++) {
+      if (!grouped) {
+        CPU_ZERO(&cur);
+        CPU_SET(i, &cur);
+        if (!cpu_sets_add(sets, &n, &cur))
+          goto bad;
+        CPU_ZERO(&cur);
+      } else {
+        CPU_SET(i, &cur);
+      }
+    }
+
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p == ';' && !single) {
+      if (!cpu_sets_add(sets, &n, &cur))
+        goto bad;
+      CPU_ZERO(&cur);
+      p++;
+    } else if (*p == ',' || *p == ';') {
+      p++;
+    } else if (*p) {
+      goto bad;
+    }
+  }
+
+  if (CPU_COUNT(&cur) && !cpu_sets_add(sets, &n, &cur))
+    goto bad;
+  return n;
+
+bad:
+  free(*sets);
+  *sets = NULL;
+  return -1;
+}
+
 void base_conf_init(const Setup *setup) {
   base_conf.nthreads = setup->MAX_CMD_THREAD_NUM;
   base_conf.nreqs_per_event = setup->REQS_PER_EVENT;
   base_conf.listen_backlog = setup->LISTEN_QUE_SIZE;
   base_conf.support_ipv6 = setup->SUPPORT_IPV6;
   base_conf.max_conns = setup->MAX_CONNS;
+  base_conf.reuseport = setup->LISTEN_REUSEPORT;
+  base_conf.reuseport_steering = setup->REUSEPORT_STEERING;
+  base_conf.accept_burst = setup->ACCEPT_BURST;
+  base_conf.thread_queue_size = setup->THREAD_QUEUE_SIZE;
+  base_conf.conn_cache_prewarm = setup->CONN_CACHE_PREWARM;
+  base_conf.conn_cache_max = setup->CONN_CACHE_MAX;
+  base_conf.event_engine = strcmp(setup->EVENT_ENGINE, "io_uring") == 0 ?
+      ENGINE_URING : ENGINE_LIBEVENT;
+  base_conf.uring_entries = setup->URING_ENTRIES;
+  base_conf.uring_bufs = setup->URING_BUF_COUNT;
+  base_conf.uring_bufsize = setup->URING_BUF_SIZE;
+  base_conf.zerocopy_threshold = setup->ZERO_COPY_THRESHOLD;
+  base_conf.read_size_max = setup->READ_SIZE_MAX;
+  base_conf.read_budget = setup->READ_BUDGET;
+  base_conf.read_fionread = setup->READ_FIONREAD;
+  base_conf.buffer_shrink_size = setup->BUFFER_SHRINK_SIZE;
+  base_conf.lazy_buffers = setup->LAZY_BUFFERS;
+  base_conf.buffer_pool_max = setup->BUFFER_POOL_MAX;
+  base_conf.write_coalesce = setup->WRITE_COALESCE;
+  base_conf.wbuf_high = setup->WBUF_HIGH_WATERMARK;
+  base_conf.wbuf_low = setup->WBUF_LOW_WATERMARK;
+  base_conf.wbuf_congest_timeout = setup->WBUF_CONGEST_TIMEOUT;
+  base_conf.recv_timeout = setup->CLIENT_RECV_TIMEOUT;
+  base_conf.send_timeout = setup->CLIENT_SEND_TIMEOUT;
+  base_conf.idle_timeout = setup->CLIENT_IDLE_TIMEOUT;
+  base_conf.timer_tick = setup->TIMER_TICK;
+  base_conf.clock_tick = setup->CLOCK_TICK;
+  base_conf.migrate_threshold = setup->MIGRATE_THRESHOLD;
+  base_conf.migrate_batch = setup->MIGRATE_BATCH;
+  base_conf.numa_bind = setup->NUMA_BIND;
+  base_conf.sched_fifo = setup->SCHED_FIFO_PRIO;
+  base_conf.busy_poll = setup->BUSY_POLL;
+  base_conf.busy_poll_sock = setup->BUSY_POLL_SOCKET;
+  base_conf.udp_batch = setup->UDP_BATCH;
+  base_conf.udp_payload_max = setup->UDP_PAYLOAD_MAX;
+  base_conf.udp_recv_size = setup->UDP_RECV_SIZE;
+
+  cpu_set_t *sets;
+
+  base_conf.nworker_cpus = parse_cpu_list(setup->WORKER_CPUS, false, &sets);
+  base_conf.worker_cpus = sets;
+  if (base_conf.nworker_cpus < 0) {
+    fprintf(stderr, "Bad WorkerCpus '%s', workers are not pinned\n",
+            setup->WORKER_CPUS);
+    base_conf.nworker_cpus = 0;
+  }
+
+  base_conf.dispatch_pinned = parse_cpu_list(setup->DISPATCH_CPUS, true, &sets);
+  if (base_conf.dispatch_pinned < 0)
+    fprintf(stderr, "Bad DispatchCpus '%s', dispatch thread is not pinned\n",
+            setup->DISPATCH_CPUS);
+  base_conf.dispatch_pinned = base_conf.dispatch_pinned > 0;
+  if (base_conf.dispatch_pinned)
+    base_conf.dispatch_cpus = sets[0];
+  free(sets);
+  if (strcmp(setup->WBUF_POLICY, "disconnect") == 0)
+    base_conf.wbuf_policy = WBUF_DISCONNECT;
+  else if (strcmp(setup->WBUF_POLICY, "block") == 0)
+    base_conf.wbuf_policy = WBUF_BLOCK;
+  else
+    base_conf.wbuf_policy = WBUF_DROP;
+  if (strcmp(setup->DISPATCH_POLICY, "least_conns") == 0)
+    base_conf.dispatch_policy = DISPATCH_LEAST_CONNS;
+  else if (strcmp(setup->DISPATCH_POLICY, "p2c") == 0)
+    base_conf.dispatch_policy = DISPATCH_P2C;
+  else if (strcmp(setup->DISPATCH_POLICY, "ip_hash") == 0)
+    base_conf.dispatch_policy = DISPATCH_IP_HASH;
+  else
+    base_conf.dispatch_policy = DISPATCH_RR;
+
+  if (base_conf.accept_burst < 1)
+    base_conf.accept_burst = 1;
+  else if (base_conf.accept_burst > MAX_ACCEPT_BURST)
+    base_conf.accept_burst = MAX_ACCEPT_BURST;
+
+  if (base_conf.thread_queue_size < MAX_ACCEPT_BURST)
+    base_conf.thread_queue_size = MAX_ACCEPT_BURST;
+
+  if (base_conf.conn_cache_prewarm < 0)
+    base_conf.conn_cache_prewarm = 0;
+  if (base_conf.conn_cache_max < CONN_SLAB_SIZE)
+    base_conf.conn_cache_max = CONN_SLAB_SIZE;
+
+  if (base_conf.uring_entries < MAX_ACCEPT_BURST)
+    base_conf.uring_entries = MAX_ACCEPT_BURST;
+  if (base_conf.uring_bufs < 1)
+    base_conf.uring_bufs = 1;
+  if (base_conf.uring_bufsize < DATA_BUFFER_SIZE)
+    base_conf.uring_bufsize = DATA_BUFFER_SIZE;
+  if (base_conf.zerocopy_threshold < 0)
+    base_conf.zerocopy_threshold = 0;
+  if (base_conf.read_size_max < DATA_BUFFER_SIZE)
+    base_conf.read_size_max = DATA_BUFFER_SIZE;
+  if (base_conf.read_budget <= 0)
+    base_conf.read_budget = INT_MAX;  /* unlimited */
+  else if (base_conf.read_budget < base_conf.read_size_max)
+    base_conf.read_budget = base_conf.read_size_max;
+  if (base_conf.buffer_shrink_size < DATA_BUFFER_SIZE)
+    base_conf.buffer_shrink_size = DATA_BUFFER_SIZE;
+
+  if (base_conf.buffer_pool_max < 0)
+    base_conf.buffer_pool_max = 0;
+
+  if (base_conf.wbuf_high < 0)
+    base_conf.wbuf_high = 0;
+  if (base_conf.wbuf_low <= 0 || base_conf.wbuf_low > base_conf.wbuf_high)
+    base_conf.wbuf_low = base_conf.wbuf_high / 2;
+  if (base_conf.wbuf_congest_timeout < 0)
+    base_conf.wbuf_congest_timeout = 0;
+
+  if (base_conf.recv_timeout < 0)
+    base_conf.recv_timeout = 0;
+  if (base_conf.send_timeout < 0)
+    base_conf.send_timeout = 0;
+  if (base_conf.idle_timeout < 0)
+    base_conf.idle_timeout = 0;
+  base_conf.timeout_min = 0;
+  if (base_conf.recv_timeout)
+    base_conf.timeout_min = base_conf.recv_timeout;
+  if (base_conf.send_timeout &&
+      (!base_conf.timeout_min || base_conf.send_timeout < base_conf.timeout_min))
+    base_conf.timeout_min = base_conf.send_timeout;
+  if (base_conf.idle_timeout &&
+      (!base_conf.timeout_min || base_conf.idle_timeout < base_conf.timeout_min))
+    base_conf.timeout_min = base_conf.idle_timeout;
+  if (base_conf.timer_tick < 1)
+    base_conf.timer_tick = 1;
+  else if (base_conf.timer_tick > 1000)
+    base_conf.timer_tick = 1000;
+  /*
+   * ClockTick 0 picks the coarsest tick that still serves what is on:
+   * once a second, TimerTick with timeouts, a tenth of the congestion
+   * timeout with watermarks. ms resolution has to be asked for.
+   */
+  if (base_conf.clock_tick < 1) {
+    base_conf.clock_tick = 1000;
+    if (base_conf.timeout_min && base_conf.timer_tick < base_conf.clock_tick)
+      base_conf.clock_tick = base_conf.timer_tick;
+    if (base_conf.wbuf_high && base_conf.wbuf_congest_timeout &&
+        base_conf.wbuf_congest_timeout / 10 < base_conf.clock_tick)
+      base_conf.clock_tick = base_conf.wbuf_congest_timeout / 10;
+  }
+  if (base_conf.clock_tick < 1)
+    base_conf.clock_tick = 1;
+  else if (base_conf.clock_tick > 1000)
+    base_conf.clock_tick = 1000;
+  if (base_conf.migrate_threshold < 0)
+    base_conf.migrate_threshold = 0;
+  if (base_conf.migrate_batch < 1)
+    base_conf.migrate_batch = 1;
+  if (base_conf.numa_bind < NUMA_OFF || base_conf.numa_bind > NUMA_STRICT)
+    base_conf.numa_bind = NUMA_OFF;
+  if (base_conf.numa_bind && !base_conf.nworker_cpus) {
+    fprintf(stderr, "NumaBind needs WorkerCpus, ignored\n");
+    base_conf.numa_bind = NUMA_OFF;
+  }
+  if (base_conf.busy_poll < 0)
+    base_conf.busy_poll = 0;
+  if (base_conf.busy_poll_sock < 0)
+    base_conf.busy_poll_sock = 0;
+  if (base_conf.udp_batch < 1)
+    base_conf.udp_batch = 1;
+  else if (base_conf.udp_batch > UDP_MAX_BATCH)
+    base_conf.udp_batch = UDP_MAX_BATCH;
+  if (base_conf.udp_payload_max < UDP_HEADER_SIZE + 1)
+    base_conf.udp_payload_max = UDP_HEADER_SIZE + 1;
+  else if (base_conf.udp_payload_max > UDP_DGRAM_MAX)
+    base_conf.udp_payload_max = UDP_DGRAM_MAX;
+  if (base_conf.udp_recv_size < UDP_HEADER_SIZE + 1)
+    base_conf.udp_recv_size = UDP_HEADER_SIZE + 1;
+  else if (base_conf.udp_recv_size > UDP_DGRAM_MAX)
+    base_conf.udp_recv_size = UDP_DGRAM_MAX;
+  if (base_conf.sched_fifo < 0)
+    base_conf.sched_fifo = 0;
+  else if (base_conf.sched_fifo > sched_get_priority_max(SCHED_FIFO))
+    base_conf.sched_fifo = sched_get_priority_max(SCHED_FIFO);
+  if (base_conf.event_engine == ENGINE_URING && !Uring::available())
+    base_conf.event_engine = ENGINE_LIBEVENT;
+
+  if (base_conf.reuseport && base_conf.nthreads <= 0)
+    base_conf.reuseport = 0;
 }
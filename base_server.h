@@ -9,8 +9,10 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <event.h>
 #include <event2/thread.h>
 #include <iostream>
@@ -18,16 +20,96 @@
 #include "setup.h"
 
 #define DATA_BUFFER_SIZE 2048
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE  64
+#endif
+#define MAX_ACCEPT_BURST 128
 #define BASE_INT64_LEN   sizeof("-9223372036854775808") - 1
 
 typedef unsigned int rel_time_t;
 
+/* how the kernel picks a socket inside a SO_REUSEPORT group */
+enum reuseport_steering {
+  STEER_HASH = 0,         /* kernel default 4-tuple hash */
+  STEER_INCOMING_CPU = 1, /* SO_INCOMING_CPU, worker i prefers cpu i */
+  STEER_CBPF = 2          /* cBPF program, socket index = rx cpu % nthreads */
+};
+
+enum event_engine {
+  ENGINE_LIBEVENT = 0,
+  ENGINE_URING = 1      /* io_uring, falls back to libevent per thread */
+};
+
+/* what happens to pushes for a conn congested too long */
+enum wbuf_policy {
+  WBUF_DROP = 0,          /* pushes are refused */
+  WBUF_DISCONNECT = 1,    /* the conn is closed */
+  WBUF_BLOCK = 2          /* pushers off the event loops wait, then refused */
+};
+
+/* how the dispatch thread picks a worker for an accepted conn */
+enum dispatch_policy {
+  DISPATCH_RR = 0,
+  DISPATCH_LEAST_CONNS = 1, /* fewest conns, live or queued */
+  DISPATCH_P2C = 2,         /* less loaded of two random workers */
+  DISPATCH_IP_HASH = 3      /* by client address, sticky */
+};
+
+/* where worker allocations come from, needs WorkerCpus */
+enum numa_bind {
+  NUMA_OFF = 0,
+  NUMA_PREFERRED = 1,     /* the node of the worker's cpus, others if full */
+  NUMA_STRICT = 2         /* only that node */
+};
+
 struct base_conf_t {
   int nthreads;
   int nreqs_per_event;
   int listen_backlog;
   int support_ipv6;
   int max_conns;
+  int reuseport;          /* one listener per worker, no dispatch thread */
+  int reuseport_steering; /* enum reuseport_steering */
+  int accept_burst;       /* max sockets accepted per listener event */
+  int thread_queue_size;  /* capacity of each worker's cq and push_q */
+  int conn_cache_prewarm; /* conns preallocated at startup, all workers */
+  int conn_cache_max;     /* free conns a worker keeps before giving back */
+  int event_engine;       /* enum event_engine */
+  int uring_entries;      /* sq entries per ring */
+  int uring_bufs;         /* provided recv buffers per ring */
+  int uring_bufsize;
+  int zerocopy_threshold; /* writes from this size use MSG_ZEROCOPY, 0 off */
+  int read_size_max;      /* largest single read */
+  int read_budget;        /* bytes read per conn per event */
+  int read_fionread;      /* size reads with FIONREAD */
+  int buffer_shrink_size; /* rbuf size that gets compacted once idle */
+  int lazy_buffers;       /* idle conns hold no rbuf/wbuf */
+  int buffer_pool_max;    /* spare buffers kept per thread and kind */
+  int write_coalesce;     /* one write for a batch of pipelined replies */
+  int wbuf_high;          /* output backlog making a conn congested, 0 off */
+  int wbuf_low;           /* backlog under which it is not anymore */
+  int wbuf_congest_timeout; /* ms congested before wbuf_policy applies */
+  int wbuf_policy;        /* enum wbuf_policy */
+  int recv_timeout;       /* seconds, 0 off; see conn_timer_expired */
+  int send_timeout;
+  int idle_timeout;
+  int timeout_min;        /* shortest of the above, 0 if all off */
+  int timer_tick;         /* timer wheel resolution, ms */
+  int clock_tick;         /* refresh interval of current_*, ms */
+  int dispatch_policy;    /* enum dispatch_policy */
+  int migrate_threshold;  /* load skew in percent that moves conns, 0 off */
+  int migrate_batch;      /* most conns moved per rebalance */
+  int dispatch_pinned;    /* DispatchCpus given */
+  cpu_set_t dispatch_cpus;
+  int nworker_cpus;       /* WorkerCpus groups, worker i gets i % n */
+  cpu_set_t *worker_cpus;
+  int numa_bind;          /* enum numa_bind */
+  int sched_fifo;         /* SCHED_FIFO priority of server threads, 0 off */
+  int busy_poll;          /* usec a worker spins before sleeping, 0 off */
+  int busy_poll_sock;     /* SO_BUSY_POLL usec of accepted sockets, 0 off */
+  int udp_batch;          /* datagrams per recvmmsg */
+  int udp_payload_max;    /* largest datagram sent, frame header included */
+  int udp_recv_size;      /* largest request datagram, longer are dropped */
 };
 
 void base_server_init(const Setup *settings);
@@ -41,7 +123,20 @@ void set_clock_callback(void (*cb)(rel_time_t), void (**old_cb)(rel_time_t));
 struct event_base *get_main_base();
 
 int server_socket(const char *interface, int port, int backlog);
+int server_socket_unix(const char *path, int access_mask, int backlog);
+int server_socket_udp(const char *interface, int port);
 
+/*
+ * Coarse clocks, refreshed by the main thread every ClockTick ms; reading
+ * one is a load, no syscall. current_msec/current_usec are monotonic,
+ * current_time is in seconds and never jumps with the wall clock.
+ */
 extern volatile rel_time_t current_time;
+extern volatile uint64_t   current_msec;
+extern volatile uint64_t   current_usec;
+
+const char *current_http_date();
+const char *current_log_date();
+
 extern struct base_conf_t  base_conf;
 #endif /* __BASE_SERVER_INCLUDE__ */
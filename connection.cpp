@@ -6,18 +6,48 @@
 
 #include <fcntl.h>
 #include <errno.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#include <algorithm>
+#include <deque>
 #include <vector>
-#include <map>
 
 #include "connection.h"
 #include "util.h"
 #include "thread.h"
+#include "uring.h"
+#include "udp.h"
+#include "pubsub.h"
 #include "log.h"
 
 using namespace std;
 
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+/* seconds the zerocopy buffers of a closed conn are kept around */
+#define ZEROCOPY_LINGER 10
+#define ZEROCOPY_MAX_IOV 64
+
 static const char* state_names[] = {
   "conn_listening",
+  "conn_datagram",
   "conn_new_req",
   "conn_waiting",
   "conn_read",
@@ -27,28 +57,126 @@ static const char* state_names[] = {
   "conn_unknown"
 };
 
-#define FREE_CONNS 200
+/*
+ * A slab is one cache line aligned allocation of CONN_SLAB_SIZE conns.
+ * Conns parked in the depot are kept on their slab, so a slab whose conns
+ * are all back in the depot can be freed once the depot holds more than
+ * the prewarm size: memory taken during a spike is given back.
+ */
+struct conn_slab {
+  conn_slab        *prev;
+  conn_slab        *next;
+  conn             *depot_free;  /* conns of this slab parked in the depot */
+  int               ndepot;
+  conn             *conns;
+};
+
+static conn_slab      *depot_slabs = NULL;
+static int             depot_nfree = 0;
+/* Lock for the depot, workers only take it to refill or spill a batch */
+static pthread_mutex_t depot_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * fd indexed connection table. Slots are read without locks: a reader
+ * checks the handle before and after picking up the other fields. The
+ * slot lock only serializes conn_thread_safe_op against the slot being
+ * released, it is never taken on the accept or push path of other fds.
+ * push_lock keeps pushes to the fd from racing a conn_migrate().
+ */
+struct conn_slot {
+  conn_handle_t     handle;  /* CONN_HANDLE_NULL while the slot is free */
+  conn             *c;
+  LibeventThread   *thread;  /* owner, the only thread touching c */
+  uint32_t          gen;     /* generation of the last handle handed out */
+  int               lock;
+  int               push_lock;
+  size_t            wlen;    /* output backlog, published by the owner */
+  uint64_t          congest_usec; /* copy of conn->congest_usec */
+};
+
+static conn_slot *conn_slots = NULL;
+static int        conn_slots_size = 0;
+static int        conn_count = 0;
+
+static void conn_add_to_freelist(LibeventThread *thread, conn *c);
+
+static inline void conn_slot_lock(conn_slot *slot) {
+  while (__sync_lock_test_and_set(&slot->lock, 1))
+    sched_yield();
+}
+
+static inline void conn_slot_unlock(conn_slot *slot) {
+  __sync_lock_release(&slot->lock);
+}
+
+static inline void conn_push_lock(conn_slot *slot) {
+  while (__sync_lock_test_and_set(&slot->push_lock, 1))
+    sched_yield();
+}
 
-static vector<conn *> *free_conns = NULL;
-/* Lock for connection freelist */
-static pthread_mutex_t freeconn_lock = PTHREAD_MUTEX_INITIALIZER;
+static inline void conn_push_unlock(conn_slot *slot) {
+  __sync_lock_release(&slot->push_lock);
+}
 
-static map<int, conn*> *fd_map = NULL;
-static pthread_mutex_t fd_map_lock = PTHREAD_MUTEX_INITIALIZER;
+static inline conn_slot *conn_slot_of(int fd) {
+  if (fd < 0 || fd >= conn_slots_size)
+    return NULL;
+  return &conn_slots[fd];
+}
+static conn *conn_from_freelist(LibeventThread *thread);
 
-static bool conn_add_to_freelist(conn *c);
-static conn *conn_from_freelist();
+static bool conn_slot_add(conn *c);
+static void conn_slot_del(conn *c);
 
-static void conn_add_to_fd_map(int fd, conn *c);
-static void conn_del_from_fd_map(int fd);
+static void conn_live_link(LibeventThread *thread, conn *c);
+static void conn_live_unlink(LibeventThread *thread, conn *c);
 
 static void conn_cleanup(conn *c);
 
+/* listeners and datagram sockets, as opposed to a client conn */
+static inline bool conn_is_server_socket(enum conn_states state) {
+  return state == conn_listening || state == conn_datagram;
+}
+
 static void event_handler(int fd, short which, void *arg);
+static void conn_reschedule(conn *c);
+static void conn_timer_arm(conn *c);
 static void drive_machine(conn *c);
+static void conn_accept_burst(conn *c);
 
 static void push_event_handler(int fd, short which, void *arg);
 
+/*
+ * Transmit state of a conn that has sent with MSG_ZEROCOPY. Everything
+ * from the first zerocopy send on goes through buf, in order, and stays
+ * there until the kernel reports the pages released: spans map byte
+ * offsets of buf to the send that carried them.
+ */
+struct zc_span {
+  uint32_t          seq;       /* kernel counter of the send, if zerocopy */
+  size_t            end;       /* offset in buf right after this send */
+  bool              zerocopy;
+};
+
+struct conn_zc {
+  struct evbuffer  *buf;
+  size_t            sent;      /* bytes of buf handed to the socket */
+  uint32_t          next_seq;  /* the kernel numbers zerocopy sends from 0 */
+  uint32_t          done_seq;  /* sends before this one are released */
+  deque<zc_span>    spans;
+  vector<pair<uint32_t, uint32_t> > ooo; /* released out of order */
+  bool              enabled;   /* SO_ZEROCOPY is set on the socket */
+  bool              disabled;  /* refused, or the kernel copies anyway */
+  rel_time_t        closed;
+  conn_zc          *next;      /* linger list of the thread */
+};
+
+static size_t conn_zc_unsent(conn *c);
+static bool conn_zc_enable(conn *c);
+static int conn_zc_write(conn *c);
+static void conn_zc_reap(conn *c);
+static void conn_zc_closed(conn *c);
+
 enum try_read_result {
   READ_DATA_RECEIVED,
   READ_NO_DATA_RECEIVED,
@@ -56,9 +184,10 @@ enum try_read_result {
   READ_MEMORY_ERROR      /** failed to allocate more memory */
 };
 
-static enum try_read_result try_conn_read(conn *c);
+static enum try_read_result try_conn_read(conn *c, int *budget);
 
 static enum write_buf_result conn_write_buf(conn *c);
+static void conn_wbuf_watch(conn *c);
 
 static volatile bool allow_new_conns = true;
 
@@ -81,40 +210,216 @@ void set_request_parser(parse_request_pt parser) {
 
 void conn_init() {
   set_request_parser(dummy_parse_request);
- 
-  if (!free_conns) {
-    free_conns = new vector<conn *>();
-    assert(free_conns);
+
+  if (!conn_slots) {
+    struct rlimit rl;
+
+    conn_slots_size = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+        rl.rlim_cur > (rlim_t)conn_slots_size) {
+      conn_slots_size = rl.rlim_cur > (1 << 24) ? (1 << 24) : rl.rlim_cur;
+    }
+
+    conn_slots = (conn_slot *)calloc(conn_slots_size, sizeof(conn_slot));
+    assert(conn_slots);
   }
+}
+
+static struct evbuffer *conn_wbuf_new() {
+  struct evbuffer *buf = evbuffer_new();
 
-  if (!fd_map) {
-    fd_map = new map<int, conn*>();
-    assert(fd_map); 
+  if (!buf)
+    return NULL;
+
+  if (evbuffer_enable_locking(buf, NULL) != 0) {
+    evbuffer_free(buf);
+    return NULL;
   }
 
-  for (int i = 0; i < FREE_CONNS; i++) {
-    conn *c = (conn *)calloc(1, sizeof(conn));
-    
-    if (c == NULL) {
-      perror("conn_init calloc()");  
-      continue;
+  /* file segments added by conn_add_file go out with sendfile */
+  evbuffer_set_flags(buf, EVBUFFER_FLAG_DRAINS_TO_FD);
+  return buf;
+}
+
+static bool conn_buffers_init(conn *c) {
+  if (!c->rbuf && !(c->rbuf = evbuffer_new()))
+    return false;
+
+  if (!c->wbuf && !(c->wbuf = conn_wbuf_new()))
+    return false;
+  return true;
+}
+
+/*
+ * LazyBuffers mode: a conn only holds rbuf/wbuf while it has bytes in
+ * flight, idle conns read into the thread's scratch buffer first. The
+ * buffers come from and go back to small per thread pools. wbuf is
+ * attached and detached under the slot lock, conn_thread_safe_op may
+ * attach one from another thread.
+ */
+static inline size_t conn_rlen(conn *c) {
+  return c->rbuf ? evbuffer_get_length(c->rbuf) : 0;
+}
+
+static inline size_t conn_wlen(conn *c) {
+  return c->wbuf ? evbuffer_get_length(c->wbuf) : 0;
+}
+
+/* a send starts on an empty wbuf, ClientSendTimeout counts from here */
+static inline void conn_wbuf_stamp(conn *c) {
+  if (conn_wlen(c) == 0 && conn_zc_unsent(c) == 0)
+    c->write_tick = c->thread->timers.now();
+}
+
+bool conn_buffers_attach(conn *c) {
+  LibeventThread *thread = c->thread;
+
+  if (!c->rbuf) {
+    if (!thread->rbuf_pool.empty()) {
+      c->rbuf = thread->rbuf_pool.back();
+      thread->rbuf_pool.pop_back();
+    } else if (!(c->rbuf = evbuffer_new())) {
+      return false;
     }
+    thread->stats.buffer_attaches++;
+  }
 
-    c->rbuf = evbuffer_new();
-    c->wbuf = evbuffer_new();
-    
-    if (NULL == c->rbuf ||
-        NULL == c->wbuf ||
-        evbuffer_enable_locking(c->wbuf, NULL) != 0) {
-      conn_free(c);
-      dlog1("evbuffer_new error or enable locking error\n");
-      continue;
+  if (!c->wbuf) {
+    struct evbuffer *buf;
+
+    if (!thread->wbuf_pool.empty()) {
+      buf = thread->wbuf_pool.back();
+      thread->wbuf_pool.pop_back();
+    } else if (!(buf = conn_wbuf_new())) {
+      return false;
+    }
+
+    conn_slot *slot = conn_slot_of(c->fd);
+
+    if (slot)
+      conn_slot_lock(slot);
+    if (!c->wbuf) {
+      c->wbuf = buf;
+      buf = NULL;
     }
+    if (slot)
+      conn_slot_unlock(slot);
 
-    free_conns->push_back(c); 
+    if (buf)
+      thread->wbuf_pool.push_back(buf);
+    thread->stats.buffer_attaches++;
   }
+  return true;
+}
 
-  return;
+static void conn_buffer_put(vector<struct evbuffer*> &pool,
+                            struct evbuffer *buf) {
+  if (pool.size() < (size_t)base_conf.buffer_pool_max)
+    pool.push_back(buf);
+  else
+    evbuffer_free(buf);
+}
+
+/* gives drained buffers back to the pools of thread */
+static void conn_buffers_release(conn *c, LibeventThread *thread) {
+  struct evbuffer *buf = NULL;
+
+  if (!base_conf.lazy_buffers || c->wfiles || c->state == conn_write)
+    return;
+
+  if (c->rbuf && evbuffer_get_length(c->rbuf) == 0) {
+    conn_buffer_put(thread->rbuf_pool, c->rbuf);
+    c->rbuf = NULL;
+  }
+
+  if (c->wbuf && evbuffer_get_length(c->wbuf) == 0) {
+    conn_slot *slot = conn_slot_of(c->fd);
+
+    if (slot)
+      conn_slot_lock(slot);
+    if (evbuffer_get_length(c->wbuf) == 0) {
+      buf = c->wbuf;
+      c->wbuf = NULL;
+    }
+    if (slot)
+      conn_slot_unlock(slot);
+
+    if (buf)
+      conn_buffer_put(thread->wbuf_pool, buf);
+  }
+}
+
+/* caller holds depot_lock */
+static void conn_slab_free(conn_slab *slab) {
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    depot_slabs = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+
+  for (int i = 0; i < CONN_SLAB_SIZE; i++)
+    conn_free(&slab->conns[i]);
+
+  depot_nfree -= CONN_SLAB_SIZE;
+  free(slab);
+}
+
+static bool conn_slab_new(LibeventThread *thread) {
+  conn_slab *slab;
+  void      *mem;
+  size_t     hdr = (sizeof(conn_slab) + CACHE_LINE_SIZE - 1) &
+                   ~(size_t)(CACHE_LINE_SIZE - 1);
+
+  if (posix_memalign(&mem, CACHE_LINE_SIZE,
+                     hdr + CONN_SLAB_SIZE * sizeof(conn)) != 0) {
+    perror("conn_slab_new posix_memalign()");
+    return false;
+  }
+
+  memset(mem, 0, hdr + CONN_SLAB_SIZE * sizeof(conn));
+  slab = (conn_slab *)mem;
+  slab->conns = (conn *)((char *)mem + hdr);
+
+  for (int i = 0; i < CONN_SLAB_SIZE; i++) {
+    conn *c = &slab->conns[i];
+
+    c->slab = slab;
+    c->next = thread->free_conns.free;
+    thread->free_conns.free = c;
+    thread->free_conns.nfree++;
+  }
+
+  pthread_mutex_lock(&depot_lock);
+  slab->next = depot_slabs;
+  if (depot_slabs)
+    depot_slabs->prev = slab;
+  depot_slabs = slab;
+  pthread_mutex_unlock(&depot_lock);
+
+  thread->stats.conn_slabs++;
+  return true;
+}
+
+/*
+ * Runs on the worker itself before it starts serving, so conns and their
+ * buffers are first touched by the thread that is going to use them.
+ */
+void conn_cache_prewarm(LibeventThread *thread, int n) {
+  conn *c;
+
+  while (thread->free_conns.nfree < n) {
+    if (!conn_slab_new(thread))
+      break;
+  }
+
+  if (base_conf.lazy_buffers)
+    return;
+
+  for (c = thread->free_conns.free; c; c = c->next) {
+    if (!conn_buffers_init(c))
+      dlog1("evbuffer_new error or enable locking error\n");
+  }
 }
 
 conn *conn_new(int sfd, enum conn_states init_state,
@@ -122,31 +427,28 @@ conn *conn_new(int sfd, enum conn_states init_state,
   assert(thread);
 
   struct event_base *base = thread->get_event_base();
-  conn *c = conn_from_freelist();
+  /*
+   * Listeners of a worker are set up by the main thread, on its cache;
+   * a failed conn goes back there and the main thread counts its epoll_ctl.
+   */
+  LibeventThread *home = thread->in_thread() ? thread : get_main_thread();
+  conn *c = conn_from_freelist(home);
  
   if (NULL == c) {
-    if (!(c = (conn *)calloc(1, sizeof(conn)))) {
-      dlog1("conn_new calloc error\n");
-      return NULL;
-    }
-    
-    c->rbuf = evbuffer_new();
-    c->wbuf = evbuffer_new();
+    dlog1("conn_new no free conn\n");
+    return NULL;
+  }
 
-    if (NULL == c->rbuf ||
-        NULL == c->wbuf ||
-        evbuffer_enable_locking(c->wbuf, NULL) != 0 ) {
-      conn_free(c);
-      dlog1("evbuffer_new error or enable locking error\n");
-      return NULL;
-    }
-  } else {
-    evbuffer_drain(c->rbuf, evbuffer_get_length(c->rbuf)); 
-    evbuffer_drain(c->wbuf, evbuffer_get_length(c->wbuf));  
+  if (!base_conf.lazy_buffers && !conn_buffers_init(c)) {
+    dlog1("evbuffer_new error or enable locking error\n");
+    conn_add_to_freelist(home, c);
+    return NULL;
   }
 
-  if (!c->host)
-    c->host = new string();
+  if (c->rbuf)
+    evbuffer_drain(c->rbuf, evbuffer_get_length(c->rbuf)); 
+  if (c->wbuf)
+    evbuffer_drain(c->wbuf, evbuffer_get_length(c->wbuf));  
 
   c->thread = thread;
   c->push_event_handler = push_event_handler; 
@@ -155,20 +457,62 @@ conn *conn_new(int sfd, enum conn_states init_state,
   c->state = init_state;
   c->parse_to_go = conn_unknown;
   c->write_to_go = conn_unknown;
-
-  event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
+  c->io_ready = 0;
+  c->read_size = DATA_BUFFER_SIZE;
+  c->rbuf_peak = 0;
+  c->congest_usec = 0;
+  c->congest_callback = NULL;
+  c->active_tick = thread->timers.now();
+  c->write_tick = c->active_tick;
+
+  /*
+   * Connections are registered once, edge-triggered for both directions;
+   * update_event only records what the state machine is waiting for.
+   * Listeners stay level-triggered so they can be switched off, datagram
+   * sockets so that a batch left in the queue is read on the next round.
+   */
+  if (!conn_is_server_socket(init_state))
+    event_set(&c->event, sfd, EV_READ | EV_WRITE | EV_PERSIST | EV_ET,
+              event_handler, (void *)c);
+  else
+    event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
   event_base_set(base, &c->event);
   c->ev_flags = event_flags;
 
-  if (event_add(&c->event, NULL) == -1) {
-    if (!conn_add_to_freelist(c)) {
-      conn_free(c);
-    }
+  if (!conn_slot_add(c)) {
+    dlog1("fd %d is out of the connection table\n", sfd);
+    conn_cleanup(c);
+    conn_add_to_freelist(home, c);
+    return NULL;
+  }
+
+  /*
+   * io_uring threads never add the event, it only serves event_active;
+   * datagram sockets are read with recvmmsg on either engine.
+   */
+  if (thread->uring && init_state != conn_datagram ?
+      !thread->uring->start(c) : event_add(&c->event, NULL) == -1) {
     perror("event_add");
+    conn_slot_del(c);
+    conn_cleanup(c);
+    conn_add_to_freelist(home, c);
     return NULL;
   }
- 
-  conn_add_to_fd_map(c->fd, c);
+
+  if (!thread->uring)
+    home->stats.epoll_ctls++;
+
+  if (!conn_is_server_socket(init_state)) {
+    if (base_conf.busy_poll_sock &&
+        setsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL, &base_conf.busy_poll_sock,
+                   sizeof(base_conf.busy_poll_sock)) != 0)
+      dlog1("setsockopt(SO_BUSY_POLL): %s\n", strerror(errno));
+    conn_live_link(thread, c);
+    /* read by the dispatcher, see dispatch_conns */
+    __atomic_add_fetch(&thread->nconns, 1, __ATOMIC_RELAXED);
+    if (base_conf.timeout_min)
+      conn_timer_arm(c);
+  }
   return c;
 }
 
@@ -185,21 +529,40 @@ static void conn_cleanup(conn *c) {
   c->thread = NULL; 
   c->push_event_handler = NULL; 
   c->next = NULL;
-  c->host->clear();
-  c->port = 0;
-  evbuffer_drain(c->rbuf, evbuffer_get_length(c->rbuf)); 
-  evbuffer_drain(c->wbuf, evbuffer_get_length(c->wbuf));
+  c->prev = NULL;
+  c->peer_len = 0;
+  c->peer_name[0] = '\0';
+  c->peer_cred.pid = 0;
+  if (c->rbuf)
+    evbuffer_drain(c->rbuf, evbuffer_get_length(c->rbuf)); 
+  if (c->wbuf)
+    evbuffer_drain(c->wbuf, evbuffer_get_length(c->wbuf));
 }
 
+/*
+ * Releases what a conn owns. The conn itself lives in a slab and goes
+ * away with it.
+ */
 void conn_free(conn *c) {
   if (c) {
     if (c->rbuf)
       evbuffer_free(c->rbuf);
     if (c->wbuf)
       evbuffer_free(c->wbuf);
-    if (c->host)
-      delete c->host;
-    free(c);
+    c->rbuf = NULL;
+    c->wbuf = NULL;
+
+    if (c->uio) {
+      evbuffer_free(c->uio->sendbuf);
+      free(c->uio);
+      c->uio = NULL;
+    }
+
+    if (c->zc) {
+      evbuffer_free(c->zc->buf);
+      delete c->zc;
+      c->zc = NULL;
+    }
   }
 }
 
@@ -209,20 +572,42 @@ void conn_close(conn *c) {
     return;
   }
 
-  dlog4("conn_close conn fd:%d, (%s:%d)\n", c->fd, c->host->c_str(), c->port);
+  dlog4("conn_close conn fd:%d, (%s)\n", c->fd, conn_peer_name(c));
 
-  conn_del_from_fd_map(c->fd);
+  conn_slot_del(c);
   
   if (c->close_callback)
     c->close_callback(c); 
 
+  LibeventThread *thread = c->thread;
+
+  if (c->subs)
+    pubsub_conn_closed(c);
+
+  if (!conn_is_server_socket(c->state)) {
+    conn_live_unlink(thread, c);
+    __atomic_sub_fetch(&thread->nconns, 1, __ATOMIC_RELAXED);
+  }
+  thread->timers.del(&c->timer);
   event_del(&c->event);
+  if (thread->uring)
+    thread->uring->conn_closed(c);
+  else
+    thread->stats.epoll_ctls++;
+  if (c->zc)
+    conn_zc_closed(c);
   close(c->fd);
    
   conn_cleanup(c);
-  if (!conn_add_to_freelist(c)) {
-    conn_free(c); 
+  if (base_conf.lazy_buffers) {
+    /* out of the slot table already, nobody else sees the buffers */
+    if (c->rbuf)
+      conn_buffer_put(thread->rbuf_pool, c->rbuf);
+    if (c->wbuf)
+      conn_buffer_put(thread->wbuf_pool, c->wbuf);
+    c->rbuf = c->wbuf = NULL;
   }
+  conn_add_to_freelist(thread, c);
 
   if (!allow_new_conns) {
     allow_new_conns = true;
@@ -230,107 +615,230 @@ void conn_close(conn *c) {
   }
 }
 
+/*
+ * cb runs with the slot locked, the connection can't be released (nor
+ * its fd reused) before cb returns.
+ */
 void conn_thread_safe_op(int fd, void (*cb)(conn *, void *), void *arg) {
+  conn_slot *slot = conn_slot_of(fd);
   conn *c = NULL;
-  map<int, conn *>::iterator it;
 
-  if (pthread_mutex_lock(&fd_map_lock) != 0)
+  if (!slot) {
+    cb(NULL, arg);
     return;
-
-  it = fd_map->find(fd);
-  if (it != fd_map->end()) {
-    c = it->second;
   }
 
+  conn_slot_lock(slot);
+  if (slot->handle != CONN_HANDLE_NULL)
+    c = slot->c;
+
+  /* lazy mode: cb may append to wbuf, the owner can't attach it now */
+  if (c && !c->wbuf)
+    c->wbuf = conn_wbuf_new();
+
   cb(c, arg);
-  pthread_mutex_unlock(&fd_map_lock);
+  conn_slot_unlock(slot);
 }
 
 void conn_set_state(conn *c, conn_states state) {
   assert(c);
   
   if (state != c->state) {
+    /* the parser filled wbuf, the send starts now */
+    if (state == conn_write)
+      c->write_tick = c->thread->timers.now();
     c->state = state; 
   }
 }
 
-static conn *conn_from_freelist() {
-  conn *c = NULL;
+static conn *conn_from_freelist(LibeventThread *thread) {
+  conn_cache *cache = &thread->free_conns;
+  conn *c;
  
-  if (pthread_mutex_lock(&freeconn_lock) != 0)
-    return c;
-  
-  if (!free_conns->empty()) {
-    c = free_conns->back();
-    free_conns->pop_back();
+  if (!cache->free) {
+    /* refill a batch from the depot, or carve a new slab */
+    pthread_mutex_lock(&depot_lock);
+    for (conn_slab *slab = depot_slabs;
+         slab && cache->nfree < CONN_SLAB_SIZE; slab = slab->next) {
+      while (slab->depot_free && cache->nfree < CONN_SLAB_SIZE) {
+        c = slab->depot_free;
+        slab->depot_free = c->next;
+        slab->ndepot--;
+        depot_nfree--;
+        c->next = cache->free;
+        cache->free = c;
+        cache->nfree++;
+      }
+    }
+    pthread_mutex_unlock(&depot_lock);
+
+    if (cache->free)
+      thread->stats.conn_cache_refills++;
+    else if (!conn_slab_new(thread))
+      return NULL;
   }
-  dlog4("conn_from_freelist free conns:%lu\n", free_conns->size());
-  pthread_mutex_unlock(&freeconn_lock);
 
+  c = cache->free;
+  cache->free = c->next;
+  cache->nfree--;
+  c->next = NULL;
+
+  dlog4("conn_from_freelist free conns:%d\n", cache->nfree);
   return c; 
 }
 
-static bool conn_add_to_freelist(conn *c) {
+static void conn_add_to_freelist(LibeventThread *thread, conn *c) {
   assert(c);
 
-  if (pthread_mutex_lock(&freeconn_lock) != 0)
-    return false;
+  conn_cache *cache = &thread->free_conns;
+  int keep = base_conf.nthreads > 0 ?
+             base_conf.conn_cache_prewarm / base_conf.nthreads : 0;
 
-  free_conns->push_back(c);
-  pthread_mutex_unlock(&freeconn_lock); 
-  
-  return true;
+  c->next = cache->free;
+  cache->free = c;
+  cache->nfree++;
+
+  if (cache->nfree <= base_conf.conn_cache_max)
+    return;
+
+  /* spill a batch to the depot, free slabs nobody uses any more */
+  pthread_mutex_lock(&depot_lock);
+  while (cache->nfree > base_conf.conn_cache_max - CONN_SLAB_SIZE &&
+         cache->nfree > keep) {
+    conn_slab *slab;
+
+    c = cache->free;
+    cache->free = c->next;
+    cache->nfree--;
+
+    slab = c->slab;
+    c->next = slab->depot_free;
+    slab->depot_free = c;
+    slab->ndepot++;
+    depot_nfree++;
+
+    if (slab->ndepot == CONN_SLAB_SIZE &&
+        depot_nfree - CONN_SLAB_SIZE >= base_conf.conn_cache_prewarm) {
+      conn_slab_free(slab);
+      thread->stats.conn_slabs_freed++;
+    }
+  }
+  pthread_mutex_unlock(&depot_lock);
 }
 
 conn *conn_from_fd(int fd) {
-  map<int, conn *>::iterator it;
-  conn *c = NULL;
+  conn_slot *slot = conn_slot_of(fd);
 
-  if (pthread_mutex_lock(&fd_map_lock) != 0)
+  if (!slot || __atomic_load_n(&slot->handle, __ATOMIC_ACQUIRE) == 0)
     return NULL;
 
-  it = fd_map->find(fd);
-  if (it != fd_map->end())
-    c = it->second;
+  return __atomic_load_n(&slot->c, __ATOMIC_RELAXED);
+}
 
-  pthread_mutex_unlock(&fd_map_lock);
-  return c;
+/*
+ * Only meaningful on the owning thread, everybody else should go through
+ * conn_push_handle() and friends.
+ */
+conn *conn_from_handle(conn_handle_t handle) {
+  conn_slot *slot = conn_slot_of(CONN_HANDLE_FD(handle));
+
+  if (!slot || handle == CONN_HANDLE_NULL ||
+      __atomic_load_n(&slot->handle, __ATOMIC_ACQUIRE) != handle)
+    return NULL;
+
+  return slot->c;
 }
 
-static void conn_add_to_fd_map(int fd, conn *c) {
-  if (pthread_mutex_lock(&fd_map_lock) != 0)
-    return;
+conn_handle_t conn_handle_from_fd(int fd) {
+  conn_slot *slot = conn_slot_of(fd);
 
-  fd_map->insert(pair<int, conn *>(fd, c));
+  if (!slot)
+    return CONN_HANDLE_NULL;
 
-  dlog4("conn_add_to_fd_map size:%lu\n", fd_map->size());
-  pthread_mutex_unlock(&fd_map_lock);
+  return __atomic_load_n(&slot->handle, __ATOMIC_ACQUIRE);
 }
 
-static void conn_del_from_fd_map(int fd) {
-  map<int, conn *>::iterator it; 
-  
-  if (pthread_mutex_lock(&fd_map_lock) != 0)
+/*
+ * Returns the thread owning a live handle, NULL once the connection is
+ * gone. Safe from any thread, no lock taken.
+ */
+LibeventThread *conn_handle_owner(conn_handle_t handle) {
+  conn_slot *slot = conn_slot_of(CONN_HANDLE_FD(handle));
+  LibeventThread *thread;
+
+  if (!slot || handle == CONN_HANDLE_NULL)
+    return NULL;
+
+  if (__atomic_load_n(&slot->handle, __ATOMIC_ACQUIRE) != handle)
+    return NULL;
+
+  thread = __atomic_load_n(&slot->thread, __ATOMIC_ACQUIRE);
+
+  if (__atomic_load_n(&slot->handle, __ATOMIC_ACQUIRE) != handle)
+    return NULL;
+
+  return thread;
+}
+
+static bool conn_slot_add(conn *c) {
+  conn_slot *slot = conn_slot_of(c->fd);
+
+  if (!slot)
+    return false;
+
+  conn_slot_lock(slot);
+  if (++slot->gen == 0)
+    slot->gen = 1;
+
+  c->handle = ((conn_handle_t)slot->gen << 32) | (uint32_t)c->fd;
+  slot->wlen = 0;
+  slot->congest_usec = 0;
+  __atomic_store_n(&slot->c, c, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->thread, c->thread, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->handle, c->handle, __ATOMIC_RELEASE);
+  conn_slot_unlock(slot);
+
+  __sync_fetch_and_add(&conn_count, 1);
+  return true;
+}
+
+static void conn_slot_del(conn *c) {
+  conn_slot *slot = conn_slot_of(c->fd);
+
+  if (!slot || slot->handle != c->handle)
     return;
-  
-  it = fd_map->find(fd);
-  if (it != fd_map->end())
-    fd_map->erase(it);
- 
-  dlog4("conn_del_from_fd_map size:%lu\n", fd_map->size());
-  pthread_mutex_unlock(&fd_map_lock);
+
+  conn_slot_lock(slot);
+  __atomic_store_n(&slot->handle, CONN_HANDLE_NULL, __ATOMIC_RELEASE);
+  slot->c = NULL;
+  slot->thread = NULL;
+  conn_slot_unlock(slot);
+
+  __sync_fetch_and_sub(&conn_count, 1);
 }
 
-int conn_fd_map_size() {
-  int size;
+/* live conns of a thread, so the rebalancer can pick some; owner only */
+static void conn_live_link(LibeventThread *thread, conn *c) {
+  c->prev = NULL;
+  c->next = thread->conns;
+  if (thread->conns)
+    thread->conns->prev = c;
+  thread->conns = c;
+}
 
-  if (pthread_mutex_lock(&fd_map_lock) != 0)
-    return -1;
-  
-  size = fd_map->size();
-  pthread_mutex_unlock(&fd_map_lock);
-  
-  return size;
+static void conn_live_unlink(LibeventThread *thread, conn *c) {
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    thread->conns = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  c->prev = NULL;
+  c->next = NULL;
+}
+
+int conn_fd_map_size() {
+  return __atomic_load_n(&conn_count, __ATOMIC_RELAXED);
 }
 
 bool update_event(conn *c, const int new_flags) {
@@ -340,6 +848,23 @@ bool update_event(conn *c, const int new_flags) {
   
   if (c->ev_flags == new_flags)
     return true;
+
+  /*
+   * Connections stay registered from conn_new on (edge-triggered, or
+   * io_uring recv armed all the time), only listeners are really switched.
+   */
+  if (c->state != conn_listening) {
+    c->ev_flags = new_flags;
+    return true;
+  }
+
+  if (c->thread->uring) {
+    c->ev_flags = new_flags;
+    c->thread->uring->sync(c);
+    return true;
+  }
+
+  c->thread->stats.epoll_ctls += 2;
   if (event_del(&c->event) == -1)
     return false;
  
@@ -352,7 +877,7 @@ bool update_event(conn *c, const int new_flags) {
 }
 
 static void reset_req_handler(conn *c) {
-  size_t buflen = evbuffer_get_length(c->rbuf);
+  size_t buflen = conn_rlen(c);
   
   if (buflen > 0) {
     conn_set_state(c, conn_parse_req);
@@ -361,21 +886,144 @@ static void reset_req_handler(conn *c) {
   }
 }
 
-static enum try_read_result try_conn_read(conn *c) {
+/*
+ * Reads up to size bytes straight into rbuf. evbuffer_read would cap a
+ * read at 4096 bytes and ask FIONREAD first, on every call.
+ */
+static int conn_read_some(conn *c, int size) {
+  struct evbuffer_iovec vec[2];
+  struct iovec          iov[2];
+  int                   n, i, left, nread;
+
+  /* idle conn: only take an rbuf when something arrived */
+  if (!c->rbuf) {
+    LibeventThread *thread = c->thread;
+
+    if (size > thread->scratch_size)
+      size = thread->scratch_size;
+
+    nread = read(c->fd, thread->scratch, size);
+    if (nread > 0 &&
+        (!conn_buffers_attach(c) ||
+         evbuffer_add(c->rbuf, thread->scratch, nread) != 0)) {
+      errno = ENOMEM;
+      return -1;
+    }
+    return nread;
+  }
+
+  n = evbuffer_reserve_space(c->rbuf, size, vec, 2);
+  if (n <= 0) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for (i = 0, left = size; i < n; i++) {
+    iov[i].iov_base = vec[i].iov_base;
+    iov[i].iov_len = (int)vec[i].iov_len < left ? vec[i].iov_len : left;
+    left -= iov[i].iov_len;
+  }
+
+  nread = readv(c->fd, iov, n);
+  if (nread <= 0) {
+    evbuffer_commit_space(c->rbuf, NULL, 0);
+    return nread;
+  }
+
+  for (i = 0, left = nread; i < n; i++) {
+    vec[i].iov_len = (int)iov[i].iov_len < left ? iov[i].iov_len : left;
+    left -= vec[i].iov_len;
+  }
+  evbuffer_commit_space(c->rbuf, vec, n);
+  return nread;
+}
+
+/*
+ * Read size follows recent reads: a read that fills the request doubles
+ * it up to read_size_max, one that uses less than a quarter halves it.
+ */
+static inline void conn_read_adapt(conn *c, int nread, int size) {
+  if (nread == size) {
+    if (c->read_size < base_conf.read_size_max)
+      c->read_size = c->read_size * 2 < base_conf.read_size_max ?
+                     c->read_size * 2 : base_conf.read_size_max;
+  } else if (nread < size / 4 && c->read_size > DATA_BUFFER_SIZE) {
+    c->read_size /= 2;
+  }
+}
+
+/*
+ * Once a request cycle is over, a conn whose rbuf got large puts the few
+ * bytes left into a fresh buffer: the big chain would stay allocated for
+ * as long as the keepalive conn lives.
+ */
+static void conn_buffers_shrink(conn *c) {
+  char   tmp[DATA_BUFFER_SIZE];
+  size_t len = conn_rlen(c);
+
+  if (c->rbuf_peak < (size_t)base_conf.buffer_shrink_size)
+    return;
+
+  if (len > sizeof(tmp))
+    return;
+
+  if (len > 0) {
+    evbuffer_remove(c->rbuf, tmp, len);
+    evbuffer_add(c->rbuf, tmp, len);
+  }
+
+  c->rbuf_peak = len;
+  c->read_size = DATA_BUFFER_SIZE;
+  c->thread->stats.buffer_shrinks++;
+}
+
+/*
+ * budget is what this event may still read, in bytes; a conn that runs
+ * out keeps EV_READ in io_ready and is rescheduled by the caller.
+ */
+static enum try_read_result try_conn_read(conn *c, int *budget) {
   assert(c);
   enum try_read_result gotdata;
-  int nread;
+  int nread, size, avail;
 
-  gotdata = evbuffer_get_length(c->rbuf) ?
-      READ_DATA_RECEIVED : READ_NO_DATA_RECEIVED;
+  gotdata = conn_rlen(c) ? READ_DATA_RECEIVED : READ_NO_DATA_RECEIVED;
 
-  while (1) {
-    nread = evbuffer_read(c->rbuf, c->fd, DATA_BUFFER_SIZE);
+  /* completions already filled rbuf, error was set along with eof */
+  if (c->uio) {
+    c->uio->recv_unread = 0;
+    if (!c->uio->recv_armed)
+      c->thread->uring->sync(c);  /* paused by the read budget */
+    return c->uio->eof ? READ_ERROR : gotdata;
+  }
+
+  /* nothing arrived since the socket was drained */
+  if (!(c->io_ready & EV_READ))
+    return gotdata;
+
+  while (*budget > 0) {
+    size = c->read_size;
+    if (base_conf.read_fionread &&
+        ioctl(c->fd, FIONREAD, &avail) == 0 && avail > size)
+      size = avail < base_conf.read_size_max ? avail : base_conf.read_size_max;
+    if (size > *budget)
+      size = *budget;
+
+    nread = conn_read_some(c, size);
+    c->thread->stats.io_syscalls++;
     if (nread > 0) {
       gotdata = READ_DATA_RECEIVED;
-      if (nread == DATA_BUFFER_SIZE) {
+      *budget -= nread;
+      c->thread->stats.bytes_read += nread;
+      conn_read_adapt(c, nread, size);
+
+      if (evbuffer_get_length(c->rbuf) > c->rbuf_peak)
+        c->rbuf_peak = evbuffer_get_length(c->rbuf);
+
+      if (nread == size) {
         continue;
       } else {
+        /* short read, the socket is empty; the next arrival is an edge */
+        c->io_ready &= ~EV_READ;
         break;
       }
     }
@@ -387,9 +1035,10 @@ static enum try_read_result try_conn_read(conn *c) {
 
     if (nread == -1) {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        c->io_ready &= ~EV_READ;
         break; 
       }
-      dlog1("evbuffer_read(): %s\n", strerror(errno)); 
+      dlog1("readv(): %s\n", strerror(errno)); 
       c->error = conn_rd_err;
       return READ_ERROR;
     }
@@ -401,25 +1050,46 @@ static enum try_read_result try_conn_read(conn *c) {
 static enum write_buf_result conn_write_buf(conn *c) {
   assert(c);
   int nwrite;
-  int wsize = evbuffer_get_length(c->wbuf);
+  int wsize = conn_wlen(c) + conn_zc_unsent(c);
   enum write_buf_result rv;
 
   do {
-    if (wsize == 0) {
+    if (c->thread->uring) {
+      rv = c->thread->uring->send(c);
+      break;
+    }
+
+    if (wsize == 0) {
       rv = WRITE_COMPLETE;
       break; 
     }
 
-    /* ?ֶ?Ч?ʵ? 
-    if (wsize > DATA_BUFFER_SIZE)
-      nwrite = evbuffer_write_atmost(c->wbuf, c->fd, DATA_BUFFER_SIZE); 
-    else */
+    if (!(c->io_ready & EV_WRITE)) {
+      update_event(c, EV_WRITE | EV_PERSIST);
+      rv = WRITE_SOFT_ERROR;
+      break;
+    }
+
+    if (conn_zc_unsent(c) ||
+        (base_conf.zerocopy_threshold > 0 && !c->wfiles &&
+         wsize >= base_conf.zerocopy_threshold && conn_zc_enable(c))) {
+      nwrite = conn_zc_write(c);
+    } else {
+      /* ?ֶ?Ч?ʵ? 
+      if (wsize > DATA_BUFFER_SIZE)
+        nwrite = evbuffer_write_atmost(c->wbuf, c->fd, DATA_BUFFER_SIZE); 
+      else */
       nwrite = evbuffer_write(c->wbuf, c->fd);
+      if (nwrite > 0)
+        c->thread->stats.bytes_copied += nwrite;
+    }
+    c->thread->stats.io_syscalls++;
     
     dlog4("conn_write_buf fd:%d, wsize:%d, nwrite:%d\n",
           c->fd, wsize, nwrite);
     
     if (nwrite > 0) {
+      c->write_tick = c->thread->timers.now();
       if (nwrite < wsize)
         rv = WRITE_INCOMPLETE;
       else
@@ -427,8 +1097,11 @@ static enum write_buf_result conn_write_buf(conn *c) {
       break; 
     }
 
-    if (nwrite == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    /* libevent reports a sendfile EAGAIN as 0 */
+    if (nwrite == 0 ||
+        (nwrite == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
       dlog1("evbuffer_write(): %s\n", strerror(errno));
+      c->io_ready &= ~EV_WRITE;
       if (!update_event(c, EV_WRITE | EV_PERSIST)) {
         dlog4("Couldn't update event\n");
         c->error = conn_wr_err; 
@@ -442,6 +1115,8 @@ static enum write_buf_result conn_write_buf(conn *c) {
     c->error = conn_wr_err;
     rv = WRITE_HARD_ERROR;
   } while (0);
+
+  conn_wbuf_watch(c);
  
   if (c->write_callback) {
     c->write_callback(c, rv, c->write_cb_arg);
@@ -451,31 +1126,436 @@ static enum write_buf_result conn_write_buf(conn *c) {
 }
 
 
+static size_t conn_zc_unsent(conn *c) {
+  if (!c->zc)
+    return 0;
+  return evbuffer_get_length(c->zc->buf) - c->zc->sent;
+}
+
+/* turns SO_ZEROCOPY on the first time a conn has a large write */
+static bool conn_zc_enable(conn *c) {
+  int one = 1;
+
+  if (!c->zc) {
+    c->zc = new conn_zc();
+    if (!(c->zc->buf = evbuffer_new())) {
+      delete c->zc;
+      c->zc = NULL;
+      return false;
+    }
+  }
+
+  if (c->zc->disabled)
+    return false;
+
+  if (!c->zc->enabled) {
+    if (setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+      dlog1("setsockopt(SO_ZEROCOPY): %s\n", strerror(errno));
+      c->zc->disabled = true;
+      return false;
+    }
+    c->zc->enabled = true;
+  }
+  return true;
+}
+
+static inline bool zc_seq_before(uint32_t a, uint32_t b) {
+  return (int32_t)(a - b) < 0;
+}
+
+/* drains the head of buf that the kernel no longer references */
+static void conn_zc_release(conn *c) {
+  conn_zc *zc = c->zc;
+  size_t   done = 0;
+
+  while (!zc->spans.empty()) {
+    const zc_span &s = zc->spans.front();
+    if (s.zerocopy && !zc_seq_before(s.seq, zc->done_seq))
+      break;
+    done = s.end;
+    zc->spans.pop_front();
+  }
+
+  if (!done)
+    return;
+
+  evbuffer_drain(zc->buf, done);
+  zc->sent -= done;
+  for (size_t i = 0; i < zc->spans.size(); i++)
+    zc->spans[i].end -= done;
+}
+
+/*
+ * Moves wbuf behind what is already in zc->buf and sends the unsent part.
+ * Tails below the threshold, and everything once zerocopy is disabled,
+ * go out copied; they still wait in buf behind the zerocopy sends.
+ */
+static int conn_zc_write(conn *c) {
+  conn_zc        *zc = c->zc;
+  struct iovec    iov[ZEROCOPY_MAX_IOV];
+  struct msghdr   msg;
+  struct evbuffer_ptr pos;
+  size_t          unsent;
+  bool            zerocopy;
+  int             n, flags;
+  ssize_t         nwrite;
+
+  /* file segments can't be peeked, they wait in wbuf behind buf */
+  if (!c->wfiles && c->wbuf)
+    evbuffer_add_buffer(zc->buf, c->wbuf);
+
+  unsent = evbuffer_get_length(zc->buf) - zc->sent;
+  if (unsent == 0)
+    return 0;
+
+  evbuffer_ptr_set(zc->buf, &pos, zc->sent, EVBUFFER_PTR_SET);
+  n = evbuffer_peek(zc->buf, unsent, &pos, iov, ZEROCOPY_MAX_IOV);
+  if (n > ZEROCOPY_MAX_IOV)
+    n = ZEROCOPY_MAX_IOV;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+
+  zerocopy = zc->enabled && !zc->disabled &&
+             unsent >= (size_t)base_conf.zerocopy_threshold;
+  flags = MSG_NOSIGNAL | (zerocopy ? MSG_ZEROCOPY : 0);
+
+  nwrite = sendmsg(c->fd, &msg, flags);
+  if (nwrite == -1 && zerocopy && errno == ENOBUFS) {
+    /* out of optmem for notifications, copy this one */
+    zerocopy = false;
+    nwrite = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+  }
+
+  if (nwrite <= 0)
+    return nwrite;
+
+  zc->sent += nwrite;
+
+  zc_span span;
+  span.end = zc->sent;
+  span.zerocopy = zerocopy;
+  span.seq = zerocopy ? zc->next_seq++ : 0;
+  zc->spans.push_back(span);
+
+  if (zerocopy)
+    c->thread->stats.bytes_zerocopy += nwrite;
+  else
+    c->thread->stats.bytes_copied += nwrite;
+
+  conn_zc_release(c);
+  return nwrite;
+}
+
+static void conn_zc_done(conn_zc *zc, uint32_t lo, uint32_t hi) {
+  if (zc_seq_before(zc->done_seq, lo)) {
+    zc->ooo.push_back(make_pair(lo, hi));
+    return;
+  }
+
+  if (!zc_seq_before(hi, zc->done_seq))
+    zc->done_seq = hi + 1;
+
+  /* ranges that were waiting for this one */
+  for (size_t i = 0; i < zc->ooo.size(); ) {
+    if (!zc_seq_before(zc->done_seq, zc->ooo[i].first)) {
+      if (!zc_seq_before(zc->ooo[i].second, zc->done_seq))
+        zc->done_seq = zc->ooo[i].second + 1;
+      zc->ooo.erase(zc->ooo.begin() + i);
+      i = 0;
+    } else {
+      i++;
+    }
+  }
+}
+
+/* reads zerocopy notifications off the error queue */
+static void conn_zc_reap(conn *c) {
+  conn_zc        *zc = c->zc;
+  char            control[128];
+  struct msghdr   msg;
+  struct cmsghdr *cm;
+
+  while (1) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(c->fd, &msg, MSG_ERRQUEUE) == -1)
+      break;
+
+    for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+      struct sock_extended_err *serr;
+
+      if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+          !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+        continue;
+
+      serr = (struct sock_extended_err *)CMSG_DATA(cm);
+      if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+        continue;
+
+      c->thread->stats.zc_completions += serr->ee_data - serr->ee_info + 1;
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        /* e.g. loopback: notifications for nothing, stop asking */
+        c->thread->stats.zc_copied++;
+        zc->disabled = true;
+      }
+      conn_zc_done(zc, serr->ee_info, serr->ee_data);
+    }
+  }
+
+  conn_zc_release(c);
+}
+
+/*
+ * Frees the lingering zerocopy buffers of thread that are done, or all of
+ * them when the thread goes away. On the owner, from its timer too, so a
+ * thread without further zerocopy closes doesn't keep them.
+ */
+void conn_zc_sweep(LibeventThread *thread, bool all) {
+  for (conn_zc **p = &thread->zc_linger; *p; ) {
+    conn_zc *old = *p;
+    if (all || current_time - old->closed >= ZEROCOPY_LINGER) {
+      *p = old->next;
+      evbuffer_free(old->buf);
+      delete old;
+    } else {
+      p = &old->next;
+    }
+  }
+}
+
+/*
+ * Notifications stop with close(), so buffers the kernel may still read
+ * linger on the thread for ZEROCOPY_LINGER seconds. Otherwise the state
+ * is reset and kept with the conn.
+ */
+static void conn_zc_closed(conn *c) {
+  LibeventThread *thread = c->thread;
+  conn_zc        *zc = c->zc;
+
+  conn_zc_reap(c);
+  conn_zc_sweep(thread, false);
+
+  if (!zc->spans.empty()) {
+    zc->closed = current_time;
+    zc->next = thread->zc_linger;
+    thread->zc_linger = zc;
+    c->zc = NULL;
+    return;
+  }
+
+  evbuffer_drain(zc->buf, evbuffer_get_length(zc->buf));
+  zc->sent = 0;
+  zc->next_seq = 0;
+  zc->done_seq = 0;
+  zc->ooo.clear();
+  zc->enabled = false;
+  zc->disabled = false;
+}
+
 static void event_handler(int fd, short which, void *arg) {
   conn *c = (conn *)arg;
 
   assert(c);
 
-  c->which = which;
-  c->active_time = current_time;
-
   if (fd != c->fd) {
     dlog4("event_handler:event fd != conn->fd!\n");
     conn_close(c);
     return;
   }
 
+  c->io_ready |= which & (EV_READ | EV_WRITE);
+
+  /* completions come in on the error queue, flagged as EPOLLERR */
+  if (c->zc && !c->zc->spans.empty())
+    conn_zc_reap(c);
+
+  /* an edge the current state does not wait for is only remembered */
+  if ((c->state == conn_read && which == EV_WRITE) ||
+      (c->state == conn_write && which == EV_READ))
+    return;
+
+  conn_io_ready(c, which);
+}
+
+/*
+ * Timeouts. A conn is in the timer wheel of its thread once, events and
+ * writes only stamp active_tick and write_tick. When the timer fires, the
+ * deadline is worked out from what the conn is doing at that point:
+ * sending without progress (ClientSendTimeout), halfway through a request
+ * (ClientRecvTimeout) or idle (ClientIdleTimeout). A conn not due yet is
+ * re-armed, at the latest the shortest timeout later so that a switch to
+ * a stricter one is seen.
+ */
+static inline uint64_t conn_timeout_ticks(int sec) {
+  return (uint64_t)sec * 1000 / base_conf.timer_tick;
+}
+
+/*
+ * Returns the tick the conn times out at, 0 for never. counter is the
+ * stat to bump if it does.
+ */
+static uint64_t conn_deadline(conn *c, uint64_t **counter) {
+  thread_stats &stats = c->thread->stats;
+  uint64_t      since;
+  int           timeout;
+
+  if (c->state == conn_write || conn_wlen(c) > 0 || conn_zc_unsent(c) > 0) {
+    *counter = &stats.send_timeouts;
+    timeout = base_conf.send_timeout;
+    since = c->write_tick;
+  } else if (conn_rlen(c) > 0) {
+    *counter = &stats.recv_timeouts;
+    timeout = base_conf.recv_timeout;
+    since = c->active_tick;
+  } else {
+    *counter = &stats.idle_timeouts;
+    timeout = base_conf.idle_timeout;
+    since = c->active_tick > c->write_tick ? c->active_tick : c->write_tick;
+  }
+
+  return timeout ? since + conn_timeout_ticks(timeout) : 0;
+}
+
+static void conn_timer_arm(conn *c) {
+  TimerWheel &timers = c->thread->timers;
+  uint64_t   *counter;
+  uint64_t    deadline = conn_deadline(c, &counter);
+  uint64_t    next = timers.now() + conn_timeout_ticks(base_conf.timeout_min);
+
+  if (deadline && deadline < next)
+    next = deadline;
+
+  timers.add(&c->timer, next);
+}
+
+void conn_timer_expired(timer_node *node, void *arg) {
+  conn     *c = (conn *)((char *)node - offsetof(conn, timer));
+  uint64_t *counter;
+  uint64_t  deadline = conn_deadline(c, &counter);
+
+  if (deadline && deadline <= c->thread->timers.now()) {
+    dlog4("conn fd:%d timed out, state:%s\n", c->fd, state_names[c->state]);
+    (*counter)++;
+    conn_close(c);
+    return;
+  }
+
+  conn_timer_arm(c);
+}
+
+/*
+ * Runs the state machine again from the next loop iteration, without
+ * touching the event registration. which is 0 in that callback.
+ */
+static void conn_reschedule(conn *c) {
+  event_active(&c->event, 0, 0);
+}
+
+/* entry for readiness (libevent) and completions (io_uring) alike */
+void conn_io_ready(conn *c, short which) {
+  assert(c);
+
+  c->which = which;
+  c->thread->stats.events++;
+  c->active_time = current_time;
+  c->active_tick = c->thread->timers.now();
 
   drive_machine(c);
 }
 
+/* stops accepting until a connection is closed */
+void conn_listen_pause() {
+  accept_new_conns(false);
+  allow_new_conns = false;
+}
+
+/*
+ * Drains the listen backlog up to base_conf.accept_burst sockets per
+ * readiness event, accept4() hands them back already non-blocking.
+ */
+static void conn_accept_burst(conn *c) {
+  cq_item   items[MAX_ACCEPT_BURST];
+  socklen_t addrlen;
+  int       sfd;
+  int       n = 0;
+  size_t    nconns = conn_fd_map_size();
+
+  c->thread->stats.accept_events++;
+
+  while (n < base_conf.accept_burst) {
+    cq_item *item = &items[n];
+
+    addrlen = sizeof(item->addr);
+    sfd = accept4(c->fd, (struct sockaddr *)&item->addr, &addrlen,
+                  SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sfd == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        /* these are transient, so don't log anything */
+      } else if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      } else if (errno == EMFILE) {
+        dlog4("Too many open connections\n");
+        conn_listen_pause();
+      } else {
+        perror("accept4()");
+      }
+      break;
+    }
+
+    if (nconns + n > (size_t)base_conf.max_conns) {
+      dlog4("Too many open connections:%d\n", base_conf.max_conns);
+      close(sfd);
+      conn_listen_pause();
+      break;
+    }
+
+    /* unnamed unix domain peers fill in the family only */
+    if (addrlen < sizeof(item->addr))
+      memset((char *)&item->addr + addrlen, 0, sizeof(item->addr) - addrlen);
+
+    item->sfd = sfd;
+    item->init_state = conn_new_req;
+    item->event_flags = EV_READ | EV_PERSIST;
+    item->accept_usec = Util::MonoUsec();
+    n++;
+  }
+
+  if (n > 0)
+    dispatch_conn_batch(c->thread, items, n);
+}
+
+/*
+ * WriteCoalesce: responses to pipelined requests stay in wbuf while the
+ * next request is already buffered, the whole batch goes out with one
+ * write. Anything held back is flushed before the conn leaves the parse
+ * loop, next is where it goes afterwards.
+ */
+static inline bool conn_write_deferred(conn *c) {
+  return base_conf.write_coalesce &&
+         c->parse_to_go == conn_write &&
+         c->write_to_go == conn_unknown &&
+         c->keepalive &&
+         conn_rlen(c) > 0;
+}
+
+static bool conn_flush_deferred(conn *c, enum conn_states next) {
+  if (!base_conf.write_coalesce || conn_wlen(c) == 0)
+    return false;
+
+  c->write_to_go = next;
+  conn_set_state(c, conn_write);
+  return true;
+}
+
 static void drive_machine(conn *c) {
   bool      stop = false;
-  int       sfd, flags = 1;
-  socklen_t addrlen;
-  struct sockaddr_storage addr;
   int res;
   int nreqs = base_conf.nreqs_per_event;
+  int rbudget = base_conf.read_budget;
    
   assert(c);
 
@@ -488,46 +1568,24 @@ static void drive_machine(conn *c) {
     switch (c->state) {
     
     case conn_listening:
-      addrlen = sizeof(addr);
-      if ((sfd = accept(c->fd, (struct sockaddr *)&addr, &addrlen)) == -1) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
-          /* these are transient, so don't log anything */
-          perror("accept()");
-          stop = true;
-        } else if (errno == EMFILE) {
-          dlog4("Too many open connections\n");
-          accept_new_conns(false);
-          allow_new_conns = false; 
-          stop = true;
-        } else {
-          perror("accept()");
-          stop = true;
-        }
-        break;
-      }
-
-      if (fd_map->size() > (size_t)base_conf.max_conns) {
-        dlog4("Too many open connections:%d\n", base_conf.max_conns);
-        close(sfd);
-        accept_new_conns(false);
-        allow_new_conns = false; 
-        stop = true;
-        break;
-      }
+      conn_accept_burst(c);
+      stop = true;
+      break;
 
-      if ((flags = fcntl(sfd, F_GETFL, 0)) < 0 ||
-        fcntl(sfd, F_SETFL, flags | O_NONBLOCK) < 0) {
-        perror("setting O_NONBLOCK");
-        close(sfd);
-        break;
-      }
-      
-      dispatch_conn_new(sfd, conn_new_req, EV_READ | EV_PERSIST, &addr);
+    case conn_datagram:
+      udp_process(c, default_request_parser);
       stop = true;
       break;
 
     case conn_read:
-      res = try_conn_read(c);
+      if (c->congest_usec) {
+        /* output over the high watermark, conn_wbuf_watch resumes */
+        c->thread->stats.read_pauses++;
+        stop = true;
+        break;
+      }
+
+      res = try_conn_read(c, &rbudget);
        
       dlog4("try_conn_read fd:%d, gotdata:%d\n", c->fd, res); 
 
@@ -556,32 +1614,49 @@ static void drive_machine(conn *c) {
         break;
       }
 
+      conn_buffers_shrink(c);
       conn_set_state(c, conn_read);
+      conn_buffers_release(c, c->thread);
+
+      /* unread bytes in the socket will not raise another edge */
+      if (c->io_ready & EV_READ) {
+        if (rbudget > 0)
+          break;
+        /* read budget used up, let other connections run first */
+        c->thread->stats.read_budget_hits++;
+        conn_reschedule(c);
+      }
       stop = true;
       break;
 
     case conn_new_req:
       if (--nreqs >= 0) {
         reset_req_handler(c);
+      } else if (conn_flush_deferred(c, conn_new_req)) {
+        break;
       } else {
-        if (evbuffer_get_length(c->rbuf) > 0) {
-          if (!update_event(c, EV_WRITE | EV_PERSIST)) {
-            dlog4("couldn't update event\n");
-            conn_set_state(c, conn_closing);
-          }
-        }
+        /* budget used up, let other connections run first */
+        if (conn_rlen(c) > 0 || (c->io_ready & EV_READ))
+          conn_reschedule(c);
         stop = true;
       }
       break;
 
     case conn_parse_req:
+      if (!conn_buffers_attach(c)) {
+        conn_set_state(c, conn_closing);
+        break;
+      }
+
       switch (default_request_parser(c)) {
       case PARSE_NEED_MORE_DATA:
-        conn_set_state(c, conn_waiting);
+        if (!conn_flush_deferred(c, conn_waiting))
+          conn_set_state(c, conn_waiting);
         break;
       
       case PARSE_BAD_CLIENT:
-        conn_set_state(c, conn_closing);
+        if (!conn_flush_deferred(c, conn_closing))
+          conn_set_state(c, conn_closing);
         break;
 
       case PARSE_INNER_ERROR:
@@ -589,7 +1664,11 @@ static void drive_machine(conn *c) {
         break; 
       
       case PARSE_OK:
-        if (c->parse_to_go != conn_unknown)
+        c->thread->stats.requests++;
+        if (conn_write_deferred(c)) {
+          c->thread->stats.writes_coalesced++;
+          conn_set_state(c, conn_new_req);
+        } else if (c->parse_to_go != conn_unknown)
           conn_set_state(c, c->parse_to_go);
         else {
           conn_set_state(c, c->keepalive ? conn_new_req : conn_closing);
@@ -648,73 +1727,467 @@ static void drive_machine(conn *c) {
 bool conn_push_data(conn *c, const char* data, int data_len) {
   assert(c);
 
-  bool  rv = false;
+  return conn_push_handle(c->handle, data, data_len);
+}
 
-  if (c) {
-    rv = evbuffer_add(c->wbuf, data, data_len);
-    if (rv)
-      conn_push_notify(c);
+bool conn_push_data(int fd, const char* data, int data_len) {
+  return conn_push_handle(conn_handle_from_fd(fd), data, data_len);
+}
+
+bool conn_push_data(int fd, evbuffer *buf) {
+  return conn_push_handle(conn_handle_from_fd(fd), buf);
+}
+
+/*
+ * Write watermarks. The owner publishes the output backlog of a conn in
+ * its slot, pushers on any thread read it there. Above WbufHighWatermark
+ * the conn is congested and stops reading until the backlog is back under
+ * WbufLowWatermark. A conn congested for WbufCongestTimeout ms gets
+ * WbufPolicy applied to what is pushed to it.
+ */
+static void conn_wbuf_watch(conn *c) {
+  conn_slot *slot;
+  size_t     len;
+
+  if (!base_conf.wbuf_high)
+    return;
+
+  slot = conn_slot_of(c->fd);
+  if (!slot || slot->handle != c->handle)
+    return;
+
+  len = conn_wlen(c) + conn_zc_unsent(c);
+  if (c->uio && c->uio->sendbuf)
+    len += evbuffer_get_length(c->uio->sendbuf);
+  __atomic_store_n(&slot->wlen, len, __ATOMIC_RELAXED);
+
+  if (!c->congest_usec && len >= (size_t)base_conf.wbuf_high) {
+    c->congest_usec = current_usec;
+    __atomic_store_n(&slot->congest_usec, c->congest_usec, __ATOMIC_RELEASE);
+    c->thread->stats.wbuf_congested++;
+    if (c->congest_callback)
+      c->congest_callback(c, true);
+    /* io_uring would keep receiving, cancel the recv */
+    if (c->uio)
+      c->thread->uring->sync(c);
+  } else if (c->congest_usec && len <= (size_t)base_conf.wbuf_low) {
+    c->congest_usec = 0;
+    __atomic_store_n(&slot->congest_usec, 0, __ATOMIC_RELEASE);
+    if (c->congest_callback)
+      c->congest_callback(c, false);
+    if (c->uio)
+      c->thread->uring->sync(c);
+    /* reads were paused in conn_read */
+    if (c->state == conn_read)
+      conn_reschedule(c);
   }
+}
 
-  return rv;
+static inline bool conn_congest_overdue(uint64_t since) {
+  return since && current_usec - since >=
+      (uint64_t)base_conf.wbuf_congest_timeout * 1000;
 }
 
-bool conn_push_data(int fd, const char* data, int data_len) {
-  map<int, conn *>::iterator it; 
-  conn *c  = NULL;
-  bool  rv = false;
+/*
+ * Queues a push with the owner of handle. The owner is looked up and the
+ * item queued under push_lock: a conn_migrate() in between could leave
+ * the item behind on the old owner, out of order with later pushes.
+ */
+static bool conn_push_enqueue(conn_handle_t handle, evbuffer *payload) {
+  conn_slot *slot = conn_slot_of(CONN_HANDLE_FD(handle));
+  bool       queued = false;
 
-  if (pthread_mutex_lock(&fd_map_lock) != 0)
+  if (!slot)
     return false;
 
-  it = fd_map->find(fd);
-  if (it != fd_map->end())
-    c = it->second;
- 
-  if (c) {
-    rv = evbuffer_add(c->wbuf, data, data_len);
-    if (rv) 
-      conn_push_notify(c);
+  conn_push_lock(slot);
+  if (__atomic_load_n(&slot->handle, __ATOMIC_ACQUIRE) == handle)
+    queued = slot->thread->push_q_notify(push_item(handle, payload));
+  conn_push_unlock(slot);
+  return queued;
+}
+
+/* called by pushers, false means the push is refused */
+static bool conn_push_admit(conn_handle_t handle, LibeventThread *thread) {
+  conn_slot *slot = conn_slot_of(CONN_HANDLE_FD(handle));
+  uint64_t   since = __atomic_load_n(&slot->congest_usec, __ATOMIC_ACQUIRE);
+
+  if (!since)
+    return true;
+
+  switch (base_conf.wbuf_policy) {
+  case WBUF_BLOCK:
+    /*
+     * Only plain threads wait: the owner can't wait for itself to drain
+     * the conn, and any other event loop would stall all of its conns.
+     */
+    if (get_current_thread() || conn_congest_overdue(since))
+      break;
+
+    __sync_fetch_and_add(&thread->stats.push_blocked, 1);
+    while (since && !conn_congest_overdue(since)) {
+      usleep(1000);
+      if (__atomic_load_n(&slot->handle, __ATOMIC_ACQUIRE) != handle)
+        return false;
+      since = __atomic_load_n(&slot->congest_usec, __ATOMIC_ACQUIRE);
+    }
+    break;
+
+  case WBUF_DISCONNECT:
+    /* an empty push wakes the owner up, conn_push_receive closes it */
+    if (conn_congest_overdue(since))
+      conn_push_enqueue(handle, NULL);
+    break;
+
+  default:
+    break;
   }
 
-  pthread_mutex_unlock(&fd_map_lock);
+  if (!conn_congest_overdue(since))
+    return true;
 
-  return rv;
+  __sync_fetch_and_add(&thread->stats.push_dropped, 1);
+  return false;
 }
 
-bool conn_push_data(int fd, evbuffer *buf) {
-  assert(buf);
-  
-  map<int, conn *>::iterator it; 
-  conn *c  = NULL;
-  int buflen = evbuffer_get_length(buf);
+/*
+ * Owner side check of a push, empty for a plain flush request. false
+ * when it is to be dropped; the conn may have been closed then.
+ */
+static bool conn_push_accept(conn *c, bool empty) {
+  /* a datagram socket has no peer to push to */
+  if (c->state == conn_datagram) {
+    c->thread->stats.push_stale++;
+    return false;
+  }
+
+  if (base_conf.wbuf_high && conn_congest_overdue(c->congest_usec)) {
+    if (base_conf.wbuf_policy == WBUF_DISCONNECT) {
+      dlog4("conn fd:%d congested too long, close\n", c->fd);
+      c->thread->stats.congest_closed++;
+      conn_close(c);
+      return false;
+    }
+
+    /* already queued when the conn went overdue */
+    if (!empty) {
+      c->thread->stats.push_dropped++;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*
+ * Owner side of a push: appends buf (may be NULL) to wbuf and takes
+ * ownership of it. false when the push was dropped or the conn closed,
+ * the push handler is not to run then.
+ */
+bool conn_push_receive(conn *c, evbuffer *buf) {
+  assert(c);
 
-  if (buflen == 0)
+  if (!conn_push_accept(c, buf == NULL)) {
+    if (buf)
+      evbuffer_free(buf);
     return false;
+  }
+
+  if (!buf)
+    return true;
 
-  if (pthread_mutex_lock(&fd_map_lock) != 0)
+  if (!conn_buffers_attach(c)) {
+    evbuffer_free(buf);
     return false;
+  }
 
-  it = fd_map->find(fd);
-  if (it != fd_map->end())
-    c = it->second;
-  
-  if (c) {
-    evbuffer_remove_buffer(buf, c->wbuf, buflen);
-    conn_push_notify(c);
+  conn_wbuf_stamp(c);
+  evbuffer_add_buffer(c->wbuf, buf);
+  evbuffer_free(buf);
+  c->active_time = current_time;
+  c->thread->stats.pushes++;
+  conn_wbuf_watch(c);
+  return true;
+}
+
+/*
+ * Same on the owner, for bytes shared with other conns: they are added
+ * to wbuf by reference, cleanup(data, len, arg) runs on this thread once
+ * wbuf is done with them. Not called when false is returned.
+ */
+bool conn_push_reference(conn *c, const void *data, size_t len,
+                         evbuffer_ref_cleanup_cb cleanup, void *arg) {
+  assert(c);
+
+  if (!conn_push_accept(c, false) || !conn_buffers_attach(c))
+    return false;
+
+  conn_wbuf_stamp(c);
+  if (evbuffer_add_reference(c->wbuf, data, len, cleanup, arg) != 0)
+    return false;
+
+  c->active_time = current_time;
+  c->thread->stats.pushes++;
+  conn_wbuf_watch(c);
+  return true;
+}
+
+/* whether the conn is over its high watermark, from any thread */
+bool conn_push_congested(conn_handle_t handle) {
+  conn_slot *slot = conn_slot_of(CONN_HANDLE_FD(handle));
+
+  if (!slot || !base_conf.wbuf_high)
+    return false;
+
+  return __atomic_load_n(&slot->congest_usec, __ATOMIC_ACQUIRE) != 0 &&
+         __atomic_load_n(&slot->handle, __ATOMIC_ACQUIRE) == handle;
+}
+
+/* cb runs on the owner when the conn gets congested and when it drains */
+void conn_set_congest_cb(conn *c, void (*cb)(conn *, bool)) {
+  assert(c);
+
+  c->congest_callback = cb;
+}
+
+/*
+ * The payload travels in a buffer of its own through the owner's push_q;
+ * only the owner appends it to wbuf, after checking the handle once more.
+ * On failure the caller keeps ownership of payload.
+ */
+static bool conn_push_to_owner(conn_handle_t handle, evbuffer *payload) {
+  LibeventThread *thread = conn_handle_owner(handle);
+
+  if (!thread)
+    return false;
+
+  if (payload && base_conf.wbuf_high && !conn_push_admit(handle, thread))
+    return false;
+
+  return conn_push_enqueue(handle, payload);
+}
+
+bool conn_push_handle(conn_handle_t handle, const char *data, int data_len) {
+  evbuffer *payload;
+
+  if (!conn_handle_owner(handle))
+    return false;
+
+  if (!(payload = evbuffer_new()))
+    return false;
+
+  if (evbuffer_add(payload, data, data_len) != 0 ||
+      !conn_push_to_owner(handle, payload)) {
+    evbuffer_free(payload);
+    return false;
   }
 
-  pthread_mutex_unlock(&fd_map_lock);
+  return true;
+}
+
+/* buf is drained into the connection, left untouched on failure */
+bool conn_push_handle(conn_handle_t handle, evbuffer *buf) {
+  assert(buf);
+
+  evbuffer *payload;
+
+  if (evbuffer_get_length(buf) == 0)
+    return false;
+
+  if (!conn_handle_owner(handle))
+    return false;
+
+  if (!(payload = evbuffer_new()))
+    return false;
+
+  evbuffer_add_buffer(payload, buf);
+
+  if (!conn_push_to_owner(handle, payload)) {
+    evbuffer_add_buffer(buf, payload);
+    evbuffer_free(payload);
+    return false;
+  }
 
   return true;
 }
 
-void conn_push_notify(conn *c) {
+/*
+ * Batched pushes, for a thread producing messages for many conns at
+ * once. The batch is sorted by conn and then owner, keeping the order of
+ * the messages of a conn; those become a single payload. Each owner gets
+ * its part with one push_q operation and at most one wakeup. The
+ * push_locks of its conns are held meanwhile, taken in slot order so that
+ * two batches can't deadlock; a conn that migrated just before is pushed
+ * on its own afterwards. msgs[i].queued tells what became of each message, the
+ * number queued is returned.
+ */
+struct push_batch_ent {
+  conn_slot        *slot;
+  LibeventThread   *thread;
+  int               idx;     /* into msgs */
+};
+
+static bool push_batch_by_slot(const push_batch_ent &a,
+                               const push_batch_ent &b) {
+  return a.slot < b.slot;
+}
+
+static bool push_batch_by_owner(const push_batch_ent &a,
+                                const push_batch_ent &b) {
+  return a.thread < b.thread;
+}
+
+/* flags the messages of the conn whose run starts at ents[s] */
+static int conn_push_mark(conn_push_msg *msgs, const push_batch_ent *ents,
+                          size_t n, size_t s) {
+  conn_handle_t handle = msgs[ents[s].idx].handle;
+  size_t        i;
+
+  for (i = s; i < n && msgs[ents[i].idx].handle == handle; i++)
+    msgs[ents[i].idx].queued = true;
+  return (int)(i - s);
+}
+
+/* the messages of one owner, ents[0..n) */
+static int conn_push_slice(LibeventThread *thread, conn_push_msg *msgs,
+                           const push_batch_ent *ents, size_t n) {
+  vector<push_item> items, moved;
+  vector<size_t>    runs;       /* first ent of the run of each item */
+  vector<size_t>    moved_runs;
+  size_t            nitems, pushed = 0;
+  int               queued = 0;
+
+  for (size_t s = 0, e; s < n; s = e) {
+    conn_handle_t handle = msgs[ents[s].idx].handle;
+    evbuffer     *payload;
+
+    for (e = s + 1; e < n && msgs[ents[e].idx].handle == handle; e++)
+      ;
+
+    if (base_conf.wbuf_high && !conn_push_admit(handle, thread))
+      continue;
+
+    if (!(payload = evbuffer_new()))
+      continue;
+
+    for (size_t i = s; i < e; i++) {
+      const conn_push_msg &m = msgs[ents[i].idx];
+      evbuffer_add(payload, m.data, m.len);
+    }
+    items.push_back(push_item(handle, payload));
+    runs.push_back(s);
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    if (i == 0 || ents[i].slot != ents[i - 1].slot)
+      conn_push_lock(ents[i].slot);
+  }
+
+  /* only conns still living on thread stay in the slice */
+  nitems = 0;
+  for (size_t i = 0; i < items.size(); i++) {
+    conn_slot *slot = ents[runs[i]].slot;
+
+    if (__atomic_load_n(&slot->handle, __ATOMIC_ACQUIRE) == items[i].handle &&
+        __atomic_load_n(&slot->thread, __ATOMIC_ACQUIRE) == thread) {
+      items[nitems] = items[i];
+      runs[nitems++] = runs[i];
+    } else {
+      moved.push_back(items[i]);
+      moved_runs.push_back(runs[i]);
+    }
+  }
+  items.resize(nitems);
+  runs.resize(nitems);
+
+  if (thread->push_q.try_push_batch(items.empty() ? NULL : &items[0],
+                                    items.size())) {
+    pushed = items.size();
+  } else {
+    while (pushed < items.size() && thread->push_q.try_push(items[pushed]))
+      pushed++;
+    __sync_fetch_and_add(&thread->stats.push_q_full, items.size() - pushed);
+  }
+
+  for (size_t i = n; i-- > 0; ) {
+    if (i == 0 || ents[i].slot != ents[i - 1].slot)
+      conn_push_unlock(ents[i].slot);
+  }
+
+  if (pushed > 0)
+    thread->ring_doorbell();
+
+  for (size_t i = 0; i < items.size(); i++) {
+    if (i < pushed)
+      queued += conn_push_mark(msgs, ents, n, runs[i]);
+    else
+      evbuffer_free(items[i].buf);
+  }
+
+  for (size_t i = 0; i < moved.size(); i++) {
+    if (conn_push_enqueue(moved[i].handle, moved[i].buf))
+      queued += conn_push_mark(msgs, ents, n, moved_runs[i]);
+    else
+      evbuffer_free(moved[i].buf);
+  }
+
+  return queued;
+}
+
+int conn_push_batch(conn_push_msg *msgs, int n) {
+  vector<push_batch_ent> ents;
+  size_t                 nents = 0;
+  int                    queued = 0;
+
+  ents.reserve(n);
+  for (int i = 0; i < n; i++) {
+    push_batch_ent ent;
+
+    msgs[i].queued = false;
+    if (msgs[i].len <= 0 ||
+        !(ent.slot = conn_slot_of(CONN_HANDLE_FD(msgs[i].handle))))
+      continue;
+
+    ent.thread = NULL;
+    ent.idx = i;
+    ents.push_back(ent);
+  }
+
+  /* one owner lookup per conn, all its messages go the same way */
+  stable_sort(ents.begin(), ents.end(), push_batch_by_slot);
+  for (size_t s = 0, e; s < ents.size(); s = e) {
+    conn_handle_t   handle = msgs[ents[s].idx].handle;
+    LibeventThread *thread = conn_handle_owner(handle);
+
+    for (e = s; e < ents.size() && msgs[ents[e].idx].handle == handle; e++) {
+      ents[e].thread = thread;
+      if (thread)
+        ents[nents++] = ents[e];
+    }
+  }
+  ents.resize(nents);
+
+  stable_sort(ents.begin(), ents.end(), push_batch_by_owner);
+
+  for (size_t s = 0, e; s < ents.size(); s = e) {
+    for (e = s + 1; e < ents.size() && ents[e].thread == ents[s].thread; e++)
+      ;
+    queued += conn_push_slice(ents[s].thread, msgs, &ents[s], e - s);
+  }
+  return queued;
+}
+
+/*
+ * Wakes the owner to flush whatever is in wbuf. Returns false when the
+ * owning thread's push_q is full, the data then goes out with the next
+ * write on the connection.
+ */
+bool conn_push_notify(conn *c) {
   assert(c);
 
   dlog4("conn_push_notify fd:%d\n", c->fd);
-  
-  c->thread->push_q_notify(c->fd);
+
+  return conn_push_to_owner(c->handle, NULL);
 }
 
 static void push_event_handler(int fd, short which, void *arg) {
@@ -742,10 +2215,189 @@ static void push_event_handler(int fd, short which, void *arg) {
 
     if (c->keepalive == 0)
       conn_close(c);
+    else
+      conn_buffers_release(c, c->thread);
     break;
   }
 }
 
+/*
+ * Connection migration. A conn idle between requests, nothing buffered
+ * either way, can move to another worker: the owner takes it off its
+ * event base and timer wheel and queues a migrate item on the new
+ * owner's push_q, which registers it there (conn_adopt). Holding
+ * push_lock, the old owner first takes the pushes already queued with it
+ * out of its push_q, so the ones for the conn land in wbuf ahead of
+ * anything pushed after the switch. The callbacks of the conn run on the
+ * new thread from then on. Not for io_uring threads, their recv stays
+ * armed in the ring, nor for conns subscribed to a topic.
+ */
+static bool conn_migratable(conn *c, LibeventThread *to) {
+  /* parked in conn_read by conn_waiting, no request begun */
+  return c->state == conn_read && to != c->thread && !c->subs &&
+         !c->thread->uring && !to->uring &&
+         !c->wfiles && !c->congest_usec &&
+         conn_rlen(c) == 0 && conn_wlen(c) == 0 && conn_zc_unsent(c) == 0 &&
+         (!c->zc || c->zc->spans.empty());
+}
+
+/* runs on the owner of c, false when c can't move now */
+bool conn_migrate(conn *c, LibeventThread *to) {
+  assert(c && to);
+
+  LibeventThread   *from = c->thread;
+  conn_slot        *slot = conn_slot_of(c->fd);
+  vector<push_item> pending;
+  push_item         item;
+  size_t            n;
+  bool              moved;
+
+  assert(from->in_thread());
+
+  if (!slot || !conn_migratable(c, to))
+    return false;
+
+  /* queued pushes may be for c */
+  if (!c->wbuf && !conn_buffers_attach(c))
+    return false;
+
+  from->timers.del(&c->timer);
+  event_del(&c->event);
+  from->stats.epoll_ctls++;
+  conn_live_unlink(from, c);
+  __atomic_sub_fetch(&from->nconns, 1, __ATOMIC_RELAXED);
+
+  conn_push_lock(slot);
+  for (n = from->push_q.size(); n > 0 && from->push_q.try_pop(item); n--) {
+    if (item.handle != c->handle) {
+      pending.push_back(item);
+    } else if (item.buf) {
+      evbuffer_add_buffer(c->wbuf, item.buf);
+      evbuffer_free(item.buf);
+      from->stats.pushes++;
+    }
+  }
+
+  c->thread = to;
+  __atomic_store_n(&slot->thread, to, __ATOMIC_RELEASE);
+  moved = to->push_q.try_push(push_item(c->handle, NULL, true));
+  if (!moved) {
+    c->thread = from;
+    __atomic_store_n(&slot->thread, from, __ATOMIC_RELEASE);
+  }
+  conn_push_unlock(slot);
+
+  if (moved) {
+    to->ring_doorbell();
+    from->stats.migrations_out++;
+  } else {
+    conn_adopt(c);
+  }
+
+  for (size_t i = 0; i < pending.size(); i++)
+    from->push_process(pending[i]);
+  return moved;
+}
+
+/*
+ * Moves up to n conns that were active during the last second. Handles
+ * are collected first: migrating runs queued pushes, which may close
+ * conns further down the list.
+ */
+int conn_migrate_some(LibeventThread *from, LibeventThread *to, int n) {
+  vector<conn_handle_t> handles;
+  int                   moved = 0;
+
+  for (conn *c = from->conns; c && (int)handles.size() < n; c = c->next) {
+    if (c->active_time + 1 >= current_time && conn_migratable(c, to))
+      handles.push_back(c->handle);
+  }
+
+  for (size_t i = 0; i < handles.size(); i++) {
+    conn *c = conn_from_handle(handles[i]);
+
+    if (c && c->thread == from && conn_migrate(c, to))
+      moved++;
+  }
+  return moved;
+}
+
+/* registers a migrated conn with c->thread, on that thread */
+void conn_adopt(conn *c) {
+  LibeventThread *thread = c->thread;
+
+  assert(thread->in_thread());
+
+  conn_live_link(thread, c);
+  __atomic_add_fetch(&thread->nconns, 1, __ATOMIC_RELAXED);
+
+  /* the new registration reports what is ready right now */
+  c->io_ready = 0;
+  event_set(&c->event, c->fd, EV_READ | EV_WRITE | EV_PERSIST | EV_ET,
+            event_handler, (void *)c);
+  event_base_set(thread->get_event_base(), &c->event);
+  thread->stats.epoll_ctls++;
+  if (event_add(&c->event, NULL) == -1) {
+    perror("event_add");
+    conn_close(c);
+    return;
+  }
+
+  if (base_conf.timeout_min)
+    conn_timer_arm(c);
+
+  if (conn_wlen(c) > 0)
+    c->push_event_handler(c->fd, EV_WRITE, (void *)c);
+  else
+    conn_buffers_release(c, thread);
+}
+
+static void conn_file_done(struct evbuffer_file_segment const *seg,
+                           int flags, void *arg) {
+  conn *c = (conn *)arg;
+  c->wfiles--;
+}
+
+/*
+ * Queues length bytes of fd, from offset, behind what is already in wbuf.
+ * They are sent with sendfile and never enter user space; a partial send
+ * resumes where it stopped. With close_on_done fd is closed once the
+ * range is sent or the conn goes away (also when this fails). length -1
+ * means up to the end of the file. Owning thread only.
+ */
+bool conn_add_file(conn *c, int fd, off_t offset, off_t length,
+                   bool close_on_done) {
+  assert(c);
+
+  struct evbuffer_file_segment *seg;
+
+  if (!conn_buffers_attach(c)) {
+    if (close_on_done)
+      close(fd);
+    return false;
+  }
+
+  seg = evbuffer_file_segment_new(fd, offset, length,
+                                  close_on_done ? EVBUF_FS_CLOSE_ON_FREE : 0);
+  if (!seg) {
+    if (close_on_done)
+      close(fd);
+    return false;
+  }
+
+  c->wfiles++;
+  evbuffer_file_segment_add_cleanup_cb(seg, conn_file_done, c);
+  conn_wbuf_stamp(c);
+
+  if (evbuffer_add_file_segment(c->wbuf, seg, 0, -1) != 0) {
+    evbuffer_file_segment_free(seg);
+    return false;
+  }
+
+  evbuffer_file_segment_free(seg);
+  return true;
+}
+
 void conn_set_write_cb(conn *c,
     void (*cb)(conn *, enum write_buf_result, void *),
     void *arg)
@@ -756,3 +2408,130 @@ void conn_set_write_cb(conn *c,
   c->write_cb_arg = arg;
 }
 
+void conn_set_peer(conn *c, const struct sockaddr *addr, socklen_t len) {
+  assert(c);
+
+  if (len > (socklen_t)sizeof(c->peer))
+    len = sizeof(c->peer);
+
+  memcpy(&c->peer, addr, len);
+  c->peer_len = len;
+  c->peer_name[0] = '\0';
+}
+
+/*
+ * io_uring multishot accept does not report peers, those conns look the
+ * address up on first use.
+ */
+static void conn_peer_fetch(const conn *c) {
+  conn     *mc = const_cast<conn *>(c);
+  socklen_t len = sizeof(mc->peer);
+
+  if (c->peer_len || c->fd <= 0)
+    return;
+
+  if (getpeername(c->fd, (struct sockaddr *)&mc->peer, &len) == 0)
+    mc->peer_len = len;
+}
+
+/*
+ * "host:port" of the peer (the bound address for listeners), formatted
+ * the first time it is asked for and cached on the conn. Unix domain
+ * peers are the socket path, or "pid:N" for the usual unnamed client.
+ */
+const char *conn_peer_name(conn *c) {
+  assert(c);
+
+  char  host[INET6_ADDRSTRLEN];
+  int   port;
+
+  if (c->peer_name[0])
+    return c->peer_name;
+
+  conn_peer_fetch(c);
+  port = conn_peer_port(c);
+
+  switch (c->peer_len ? c->peer.ss_family : AF_UNSPEC) {
+  case AF_INET:
+    inet_ntop(AF_INET, &((struct sockaddr_in *)&c->peer)->sin_addr,
+              host, sizeof(host));
+    snprintf(c->peer_name, sizeof(c->peer_name), "%s:%d", host, port);
+    break;
+
+  case AF_INET6:
+    inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&c->peer)->sin6_addr,
+              host, sizeof(host));
+    snprintf(c->peer_name, sizeof(c->peer_name), "[%s]:%d", host, port);
+    break;
+
+  case AF_UNIX: {
+    const struct sockaddr_un *un = (const struct sockaddr_un *)&c->peer;
+    int                       n = (int)c->peer_len -
+                                  (int)offsetof(struct sockaddr_un, sun_path);
+    struct ucred              cred;
+
+    /* abstract names are not NUL terminated, peer_len bounds them */
+    if (n > (int)sizeof(un->sun_path))
+      n = sizeof(un->sun_path);
+    if (n > 0 && un->sun_path[0])
+      snprintf(c->peer_name, sizeof(c->peer_name), "%.*s",
+               (int)strnlen(un->sun_path, n), un->sun_path);
+    else if (n > 1 && un->sun_path[1])
+      snprintf(c->peer_name, sizeof(c->peer_name), "@%.*s",
+               (int)strnlen(un->sun_path + 1, n - 1), un->sun_path + 1);
+    else if (conn_peer_cred(c, &cred))
+      snprintf(c->peer_name, sizeof(c->peer_name), "pid:%d", (int)cred.pid);
+    else
+      snprintf(c->peer_name, sizeof(c->peer_name), "unix");
+    break;
+  }
+
+  default:
+    snprintf(c->peer_name, sizeof(c->peer_name), "-");
+    break;
+  }
+
+  return c->peer_name;
+}
+
+/*
+ * SO_PEERCRED of a unix domain conn: pid, uid and gid of the peer as of
+ * connect(), cached on the conn. false for any other kind of socket.
+ */
+bool conn_peer_cred(conn *c, struct ucred *cred) {
+  assert(c && cred);
+
+  socklen_t len = sizeof(c->peer_cred);
+
+  if (!c->peer_cred.pid) {
+    conn_peer_fetch(c);
+    if (!c->peer_len || c->peer.ss_family != AF_UNIX ||
+        c->state == conn_listening)
+      return false;
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_PEERCRED, &c->peer_cred, &len) != 0 ||
+        !c->peer_cred.pid) {
+      c->peer_cred.pid = 0;
+      return false;
+    }
+  }
+
+  *cred = c->peer_cred;
+  return true;
+}
+
+int conn_peer_port(const conn *c) {
+  assert(c);
+
+  conn_peer_fetch(c);
+  if (!c->peer_len)
+    return 0;
+
+  switch (c->peer.ss_family) {
+  case AF_INET:
+    return ntohs(((struct sockaddr_in *)&c->peer)->sin_port);
+  case AF_INET6:
+    return ntohs(((struct sockaddr_in6 *)&c->peer)->sin6_port);
+  }
+  return 0;
+}
@@ -6,10 +6,18 @@
 #ifndef __PS_CONNECTION_INCLUDE__
 #define __PS_CONNECTION_INCLUDE__
 
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+
 #include "base_server.h"
+#include "timer.h"
 
 enum conn_states {
   conn_listening,
+  conn_datagram,      /* a UDP socket, see udp.h */
   conn_new_req,
   conn_waiting,
   conn_read,
@@ -36,34 +44,84 @@ enum write_buf_result {
 
 typedef struct conn conn;
 
+struct conn_slab;
+struct uring_io;
+struct conn_zc;
+struct pubsub_sub;
+
+/*
+ * A connection handle is the fd plus the generation of its fd table slot.
+ * The generation changes every time the fd is reused, so a handle kept by
+ * another thread can never reach the next connection on the same fd.
+ * 0 is never a valid handle.
+ */
+typedef uint64_t conn_handle_t;
+
+#define CONN_HANDLE_NULL   ((conn_handle_t)0)
+#define CONN_HANDLE_FD(h)  ((int)((h) & 0xffffffff))
+#define CONN_HANDLE_GEN(h) ((uint32_t)((h) >> 32))
+
 class LibeventThread;
 
+/*
+ * Fields used on every event come first so that they share the first
+ * cache lines; setup/teardown-only fields follow. The peer address is
+ * kept raw and only turned into text when somebody asks for it.
+ */
 struct conn {
+  /* hot */
   int               fd;
   enum conn_states  state;
   enum conn_states  parse_to_go;
   enum conn_states  write_to_go;
-  struct event      event;
-  short             ev_flags;
+  short             ev_flags;    /* what the state machine waits for */
   short             which;
+  short             io_ready;    /* EV_READ/EV_WRITE seen since last EAGAIN */
+  int               read_size;   /* next read request, adapts to the peer */
+  int               keepalive;
+  int               error; 
+  rel_time_t        active_time;
+  uint64_t          active_tick; /* timer wheel tick of the last event */
+  uint64_t          write_tick;  /* and of the last send start or progress */
   struct evbuffer  *rbuf;
   struct evbuffer  *wbuf;
- 
-  struct event      timeout_event;
-  rel_time_t        active_time;
+  LibeventThread   *thread;
+  conn_handle_t     handle;
+  void            (*write_callback)(conn *, enum write_buf_result, void *);
+  void             *write_cb_arg;
+  void            (*push_event_handler)(int, short, void *);
+  struct event      event;
 
-  int               keepalive;
+  /* cold */
+  struct timer_node timer;     /* recv/send/idle timeouts, see timer.h */
   int               client_id;
-  int               error; 
   void            (*close_callback)(conn *c);
-  void            (*push_event_handler)(int, short, void *);
-  void            (*write_callback)(conn *, enum write_buf_result, void *);
-  void             *write_cb_arg;
+  conn             *next;      /* freelist, or live list of the owner */
+  conn             *prev;
+  struct conn_slab *slab;
+  struct uring_io  *uio;       /* io_uring state, NULL on libevent threads */
+  struct conn_zc   *zc;        /* MSG_ZEROCOPY state, NULL until first used */
+  struct pubsub_sub *subs;     /* topics subscribed to, keep c on its thread */
+  int               wfiles;    /* conn_add_file segments still in wbuf */
+  size_t            rbuf_peak; /* largest rbuf since the last shrink */
+  uint64_t          congest_usec; /* wbuf over the high watermark since */
+  void            (*congest_callback)(conn *c, bool congested);
+  socklen_t         peer_len;
+  struct sockaddr_storage peer;
+  struct ucred      peer_cred; /* unix domain peers, pid 0 until fetched */
+  char              peer_name[INET6_ADDRSTRLEN + sizeof("[]:65535")];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+#define CONN_SLAB_SIZE 32  /* conns per slab */
 
-  string           *host;
-  unsigned short    port;
-  LibeventThread   *thread;
-  conn             *next;
+/*
+ * Per thread freelist, touched only by the owning thread. It refills
+ * from (and spills to) a global depot a slab-sized batch at a time, so
+ * the depot lock is off the accept/close path almost always.
+ */
+struct conn_cache {
+  conn             *free;  /* linked through conn->next */
+  int               nfree;
 };
 
 enum try_parse_result {
@@ -73,9 +131,15 @@ enum try_parse_result {
   PARSE_INNER_ERROR     /* server inner error */
 };
 
+/*
+ * A UDP request is parsed on the conn of its socket, in state
+ * conn_datagram with the peer set to the sender. The reply is whatever
+ * the parser adds to wbuf; parse_to_go and keepalive are not looked at.
+ */
 typedef enum try_parse_result (*parse_request_pt)(conn *c);
 
 void conn_init();
+void conn_cache_prewarm(LibeventThread *thread, int n);
 conn *conn_new(int fd, enum conn_states init_state,
                int event_flags, LibeventThread *thread);
 void conn_close(conn *c);
@@ -83,9 +147,22 @@ void conn_free(conn *c);
 void conn_set_state(conn *c, conn_states state);
 
 conn *conn_from_fd(int fd);
+conn *conn_from_handle(conn_handle_t handle);
+conn_handle_t conn_handle_from_fd(int fd);
+LibeventThread *conn_handle_owner(conn_handle_t handle);
 void conn_thread_safe_op(int fd, void (*cb)(conn *, void *), void *arg);
 
+void conn_timer_expired(timer_node *node, void *arg);
+void conn_zc_sweep(LibeventThread *thread, bool all);
+
 bool update_event(conn *c, const int new_flags);
+void conn_io_ready(conn *c, short which);
+bool conn_buffers_attach(conn *c);
+
+bool conn_migrate(conn *c, LibeventThread *to);
+int conn_migrate_some(LibeventThread *from, LibeventThread *to, int n);
+void conn_adopt(conn *c);
+void conn_listen_pause();
 
 bool conn_push_data(conn *c, const char *data, int data_len);
 
@@ -93,15 +170,42 @@ bool conn_push_data(int fd, const char *data, int data_len);
 
 bool conn_push_data(int fd, evbuffer *buf);
 
-void conn_push_notify(conn *c);
+bool conn_push_handle(conn_handle_t handle, const char *data, int data_len);
+
+bool conn_push_handle(conn_handle_t handle, evbuffer *buf);
+
+/* one message of conn_push_batch(), queued is filled in by the call */
+struct conn_push_msg {
+  conn_handle_t     handle;
+  const char       *data;
+  int               len;
+  bool              queued;
+};
+
+int conn_push_batch(conn_push_msg *msgs, int n);
+
+bool conn_push_notify(conn *c);
+bool conn_push_receive(conn *c, evbuffer *buf);
+bool conn_push_reference(conn *c, const void *data, size_t len,
+                         evbuffer_ref_cleanup_cb cleanup, void *arg);
+bool conn_push_congested(conn_handle_t handle);
+void conn_set_congest_cb(conn *c, void (*cb)(conn *, bool));
 void set_request_parser(parse_request_pt parser);
 
 void conn_set_write_cb(conn *c,
     void (*cb)(conn *, enum write_buf_result, void *), void *arg);
 
+bool conn_add_file(conn *c, int fd, off_t offset, off_t length,
+                   bool close_on_done);
+
+void conn_set_peer(conn *c, const struct sockaddr *addr, socklen_t len);
+const char *conn_peer_name(conn *c);
+int conn_peer_port(const conn *c);
+bool conn_peer_cred(conn *c, struct ucred *cred);
+
 int conn_fd_map_size();
 
 #define CONN_LOG(_c, _level, _fmt, ...) \
-  LOGGER->DebugInfo(_level, "fd:%d(%s:%d) " _fmt, _c->fd, _c->host->c_str(), _c->port, ##__VA_ARGS__)
+  LOGGER->DebugInfo(_level, "fd:%d(%s) " _fmt, _c->fd, conn_peer_name(_c), ##__VA_ARGS__)
 
 #endif /* __PS_CONNECTION_INCLUDE__ */
@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) jlijian3@gmail.com
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "pubsub.h"
+#include "thread.h"
+#include "log.h"
+
+using namespace std;
+
+/* a conn on a topic, also on the conn's list of subscriptions */
+struct pubsub_sub {
+  pubsub_topic     *topic;
+  conn             *c;
+  size_t            index;     /* in the shard of c's thread */
+  pubsub_sub       *next;      /* next subscription of c */
+};
+
+/* subscribers of a topic on one worker */
+struct pubsub_shard {
+  vector<pubsub_sub *> subs;   /* owner only */
+  size_t            nsubs;     /* subs.size(), read by publishers */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct pubsub_topic {
+  string            name;
+  int               nshards;
+  pubsub_shard     *shards;    /* one per worker */
+};
+
+/* the bytes follow the header, never written after publish */
+struct pubsub_msg {
+  int               refs;      /* the publisher, and a worker holding it */
+  size_t            len;
+};
+
+/* a message on one worker: one reference on it for all the wbufs there */
+struct pubsub_share {
+  pubsub_msg       *msg;
+  int               refs;      /* wbufs holding msg, owner only */
+};
+
+static map<string, pubsub_topic *> topics;
+static pthread_mutex_t topics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline const char *pubsub_msg_data(const pubsub_msg *msg) {
+  return (const char *)(msg + 1);
+}
+
+static void pubsub_msg_put(pubsub_msg *msg) {
+  if (__atomic_sub_fetch(&msg->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    free(msg);
+}
+
+static void pubsub_share_put(pubsub_share *share) {
+  if (--share->refs > 0)
+    return;
+
+  pubsub_msg_put(share->msg);
+  free(share);
+}
+
+/* evbuffer cleanup of a reference, on the thread owning the wbuf */
+static void pubsub_share_done(const void *data, size_t len, void *arg) {
+  pubsub_share_put((pubsub_share *)arg);
+}
+
+/* finds or creates the topic called name, from any thread */
+pubsub_topic *pubsub_topic_get(const char *name) {
+  pubsub_topic *topic;
+
+  assert(name);
+
+  pthread_mutex_lock(&topics_lock);
+  map<string, pubsub_topic *>::iterator it = topics.find(name);
+  if (it != topics.end()) {
+    topic = it->second;
+  } else {
+    topic = new pubsub_topic;
+    topic->name = name;
+    topic->nshards = base_conf.nthreads;
+    topic->shards = new pubsub_shard[topic->nshards];
+    for (int i = 0; i < topic->nshards; i++)
+      topic->shards[i].nsubs = 0;
+    topics[name] = topic;
+  }
+  pthread_mutex_unlock(&topics_lock);
+  return topic;
+}
+
+const char *pubsub_topic_name(const pubsub_topic *topic) {
+  return topic->name.c_str();
+}
+
+/* subscribers on all workers, as last published by each of them */
+size_t pubsub_subscribers(const pubsub_topic *topic) {
+  size_t n = 0;
+
+  for (int i = 0; i < topic->nshards; i++)
+    n += __atomic_load_n(&topic->shards[i].nsubs, __ATOMIC_RELAXED);
+  return n;
+}
+
+/*
+ * On the owner of c. Subscribing twice is a no-op; false when c does not
+ * live on a worker or is no client conn.
+ */
+bool pubsub_subscribe(conn *c, pubsub_topic *topic) {
+  assert(c && topic);
+
+  LibeventThread *thread = c->thread;
+  pubsub_shard   *shard;
+  pubsub_sub     *sub;
+
+  assert(thread->in_thread());
+
+  if (thread->id < 0 || thread->id >= topic->nshards ||
+      c->state == conn_listening || c->state == conn_datagram)
+    return false;
+
+  for (sub = c->subs; sub; sub = sub->next) {
+    if (sub->topic == topic)
+      return true;
+  }
+
+  if (!(sub = (pubsub_sub *)malloc(sizeof(*sub))))
+    return false;
+
+  shard = &topic->shards[thread->id];
+  sub->topic = topic;
+  sub->c = c;
+  sub->index = shard->subs.size();
+  shard->subs.push_back(sub);
+  __atomic_store_n(&shard->nsubs, shard->subs.size(), __ATOMIC_RELAXED);
+
+  sub->next = c->subs;
+  c->subs = sub;
+  return true;
+}
+
+/* takes sub out of its shard, the last subscriber fills the hole */
+static void pubsub_shard_del(pubsub_sub *sub) {
+  pubsub_shard *shard = &sub->topic->shards[sub->c->thread->id];
+  pubsub_sub   *last = shard->subs.back();
+
+  shard->subs[sub->index] = last;
+  last->index = sub->index;
+  shard->subs.pop_back();
+  __atomic_store_n(&shard->nsubs, shard->subs.size(), __ATOMIC_RELAXED);
+}
+
+/* on the owner of c, false when c was not subscribed to topic */
+bool pubsub_unsubscribe(conn *c, pubsub_topic *topic) {
+  assert(c && topic);
+
+  for (pubsub_sub **p = &c->subs; *p; p = &(*p)->next) {
+    pubsub_sub *sub = *p;
+
+    if (sub->topic != topic)
+      continue;
+
+    pubsub_shard_del(sub);
+    *p = sub->next;
+    free(sub);
+    return true;
+  }
+  return false;
+}
+
+/* called by conn_close */
+void pubsub_conn_closed(conn *c) {
+  pubsub_sub *sub;
+
+  while ((sub = c->subs)) {
+    pubsub_shard_del(sub);
+    c->subs = sub->next;
+    free(sub);
+  }
+}
+
+/*
+ * Copies data once and queues it with every worker that has subscribers
+ * to topic, from any thread. A worker whose push_q is full misses the
+ * message. Returns the number of subscribers it was queued for.
+ */
+size_t pubsub_publish(pubsub_topic *topic, const void *data, size_t len) {
+  pubsub_msg *msg;
+  size_t      n = 0;
+
+  assert(topic);
+
+  if (len == 0 || !(msg = (pubsub_msg *)malloc(sizeof(*msg) + len)))
+    return 0;
+
+  msg->refs = 1;
+  msg->len = len;
+  memcpy((char *)(msg + 1), data, len);
+
+  for (int i = 0; i < topic->nshards; i++) {
+    size_t          nsubs = __atomic_load_n(&topic->shards[i].nsubs,
+                                            __ATOMIC_RELAXED);
+    LibeventThread *thread = get_worker_thread(i);
+
+    if (!nsubs || !thread)
+      continue;
+
+    __atomic_add_fetch(&msg->refs, 1, __ATOMIC_RELAXED);
+    if (!thread->push_q_notify(push_item(topic, msg))) {
+      pubsub_msg_put(msg);
+      continue;
+    }
+    n += nsubs;
+  }
+
+  pubsub_msg_put(msg);
+  return n;
+}
+
+/*
+ * Worker side of a publish: msg goes to each local subscriber by
+ * reference and is written out right away, like a push. Walked from the
+ * end, a subscriber closed on the way is replaced by one already served.
+ */
+void pubsub_deliver(LibeventThread *thread, pubsub_topic *topic,
+                    pubsub_msg *msg) {
+  pubsub_shard *shard = &topic->shards[thread->id];
+  pubsub_share *share;
+
+  thread->stats.publishes++;
+
+  if (!(share = (pubsub_share *)malloc(sizeof(*share)))) {
+    pubsub_msg_put(msg);
+    return;
+  }
+
+  /* the walk holds a reference of its own */
+  share->msg = msg;
+  share->refs = 1;
+
+  for (size_t i = shard->subs.size(); i-- > 0; ) {
+    if (i >= shard->subs.size())
+      continue;
+
+    conn *c = shard->subs[i]->c;
+
+    share->refs++;
+    if (!conn_push_reference(c, pubsub_msg_data(msg), msg->len,
+                             pubsub_share_done, share)) {
+      share->refs--;
+      continue;
+    }
+    c->push_event_handler(c->fd, EV_WRITE, (void *)c);
+  }
+
+  pubsub_share_put(share);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) jlijian3@gmail.com
+ */
+
+#ifndef __PS_PUBSUB_INCLUDE__
+#define __PS_PUBSUB_INCLUDE__
+
+#include "connection.h"
+
+class LibeventThread;
+
+/*
+ * Topic based fan-out. A conn subscribes on its own thread (typically
+ * from the parser) and stays on that thread while subscribed. Every
+ * topic keeps its subscribers per worker, touched by that worker only.
+ *
+ * A publish, from any thread, copies the message once into an immutable
+ * refcounted buffer and queues it on the push_q of each worker that has
+ * subscribers: one enqueue and at most one wakeup per worker. The worker
+ * appends the buffer to every subscriber's wbuf by reference, taking a
+ * single reference on the message for all of them.
+ *
+ * Topics are created on first use and live as long as the process.
+ */
+struct pubsub_topic;
+struct pubsub_msg;
+
+pubsub_topic *pubsub_topic_get(const char *name);
+const char *pubsub_topic_name(const pubsub_topic *topic);
+size_t pubsub_subscribers(const pubsub_topic *topic);
+
+bool pubsub_subscribe(conn *c, pubsub_topic *topic);
+bool pubsub_unsubscribe(conn *c, pubsub_topic *topic);
+void pubsub_conn_closed(conn *c);
+
+size_t pubsub_publish(pubsub_topic *topic, const void *data, size_t len);
+
+void pubsub_deliver(LibeventThread *thread, pubsub_topic *topic,
+                    pubsub_msg *msg);
+
+#endif /* __PS_PUBSUB_INCLUDE__ */
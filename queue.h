@@ -5,8 +5,15 @@
 #define _CWQ_QUEUE_H
 #include <deque>
 #include <exception>
+#include <new>
+#include <stdlib.h>
+#include <stdint.h>
 #include "mutex.h"
 
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
 
 template<class T>
 class Queue
@@ -91,4 +98,143 @@ public:
 
 };
 
+
+/*
+	bounded lock-free multi-producer / single-consumer ring.
+	every cell carries a sequence number: cell i is free for position p
+	when seq == p, and holds data for position p when seq == p + 1.
+	producers claim positions with a CAS on _tail, the only consumer
+	advances _head without atomics. try_push() fails instead of growing,
+	callers decide what to do with the overflow.
+*/
+template<class T>
+class MpscQueue
+{
+	struct cell {
+		size_t	seq;
+		T		data;
+	};
+
+	cell*	_buf;
+	size_t	_mask;
+	char	_pad0[CACHE_LINE_SIZE - sizeof(cell*) - sizeof(size_t)];
+
+	size_t	_tail;		/* next position to claim, shared by producers */
+	char	_pad1[CACHE_LINE_SIZE - sizeof(size_t)];
+
+	size_t	_head;		/* next position to consume, consumer only */
+	char	_pad2[CACHE_LINE_SIZE - sizeof(size_t)];
+
+	MpscQueue(const MpscQueue&);
+	void operator=(const MpscQueue&);
+
+public:
+	MpscQueue() : _buf(NULL), _mask(0), _tail(0), _head(0) {}
+
+	~MpscQueue() {
+		delete[] _buf;
+	}
+
+	/* capacity is rounded up to a power of two */
+	bool init(size_t capacity) {
+		size_t n = 2;
+
+		while (n < capacity)
+			n <<= 1;
+
+		_buf = new (std::nothrow) cell[n];
+		if (!_buf)
+			return false;
+
+		for (size_t i = 0; i < n; i++)
+			_buf[i].seq = i;
+		_mask = n - 1;
+		_tail = _head = 0;
+		return true;
+	}
+
+	size_t capacity() const {
+		return _mask + 1;
+	}
+
+	/* approximate when producers are active */
+	size_t size() const {
+		size_t tail = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+		size_t head = __atomic_load_n(&_head, __ATOMIC_RELAXED);
+		return tail > head ? tail - head : 0;
+	}
+
+	bool empty() const {
+		return size() == 0;
+	}
+
+	/* consumer only: the next cell is published and ready to pop */
+	bool can_pop() const {
+		const cell *c = &_buf[_head & _mask];
+		return __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) == _head + 1;
+	}
+
+	bool try_push(const T& elem) {
+		return try_push_batch(&elem, 1);
+	}
+
+	/*
+		all or nothing: claims n consecutive cells with a single CAS.
+		cells are released by the consumer in order, so the last one being
+		free means the whole range is free.
+	*/
+	bool try_push_batch(const T* elems, size_t n) {
+		size_t pos = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+
+		if (n == 0)
+			return true;
+		if (n > capacity())
+			return false;
+
+		for (;;) {
+			cell *last = &_buf[(pos + n - 1) & _mask];
+			size_t seq = __atomic_load_n(&last->seq, __ATOMIC_ACQUIRE);
+			intptr_t dif = (intptr_t)seq - (intptr_t)(pos + n - 1);
+
+			if (dif == 0) {
+				if (__atomic_compare_exchange_n(&_tail, &pos, pos + n, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+					break;
+			} else if (dif < 0) {
+				return false;	/* full */
+			} else {
+				pos = __atomic_load_n(&_tail, __ATOMIC_RELAXED);
+			}
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			cell *c = &_buf[(pos + i) & _mask];
+			c->data = elems[i];
+			__atomic_store_n(&c->seq, pos + i + 1, __ATOMIC_RELEASE);
+		}
+		return true;
+	}
+
+	bool try_pop(T& elem) {
+		cell *c = &_buf[_head & _mask];
+		size_t seq = __atomic_load_n(&c->seq, __ATOMIC_ACQUIRE);
+
+		if (seq != _head + 1)
+			return false;
+
+		elem = c->data;
+		__atomic_store_n(&c->seq, _head + _mask + 1, __ATOMIC_RELEASE);
+		__atomic_store_n(&_head, _head + 1, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	size_t pop_batch(T* elems, size_t max) {
+		size_t n = 0;
+
+		while (n < max && try_pop(elems[n]))
+			n++;
+		return n;
+	}
+};
+
 #endif
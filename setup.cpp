@@ -88,11 +88,18 @@ void Setup::GetAll(map<string, string>& keys)
 
 	LISTEN_PORT = GetInt(keys, "ListenPort", 9901);
 	LISTEN_QUE_SIZE = GetInt(keys, "ListenQueSize", 1024);
+	GetString(keys, "UnixSocket", S_UNIX_SOCKET, UNIX_SOCKET);
+	S_UNIX_SOCKET_MASK = "0700";
+	GetString(keys, "UnixSocketMask", S_UNIX_SOCKET_MASK, UNIX_SOCKET_MASK_STR);
+	UNIX_SOCKET_MASK = strtol(UNIX_SOCKET_MASK_STR, NULL, 8);
 	MAX_EPOLL_SIZE = GetInt(keys, "MaxEpollSize", 100);
 	MAX_CMD_THREAD_NUM = GetInt(keys, "MaxCmdThreadNum", 1);
 
 	CLIENT_RECV_TIMEOUT = GetInt(keys, "ClientRecvTimeout", 15);
 	CLIENT_SEND_TIMEOUT = GetInt(keys, "ClientSendTimeout", 15);
+	CLIENT_IDLE_TIMEOUT = GetInt(keys, "ClientIdleTimeout", 0);
+	TIMER_TICK = GetInt(keys, "TimerTick", 100);
+	CLOCK_TICK = GetInt(keys, "ClockTick", 0);
 
   REQS_PER_EVENT = GetInt(keys, "ReqsPerEvent", 50);
 
@@ -102,5 +109,57 @@ void Setup::GetAll(map<string, string>& keys)
 
   SUPPORT_IPV6 = GetInt(keys, "SupportIPV6", 0);
   MAX_CONNS = GetInt(keys, "MaxConns", 1024);
+
+  LISTEN_REUSEPORT = GetInt(keys, "ListenReusePort", 0);
+  REUSEPORT_STEERING = GetInt(keys, "ReusePortSteering", 0);
+  ACCEPT_BURST = GetInt(keys, "AcceptBurst", 16);
+  THREAD_QUEUE_SIZE = GetInt(keys, "ThreadQueueSize", 8192);
+  CONN_CACHE_PREWARM = GetInt(keys, "ConnCachePrewarm", 200);
+  CONN_CACHE_MAX = GetInt(keys, "ConnCacheMax", 256);
+
+  S_EVENT_ENGINE = "libevent";
+  GetString(keys, "EventEngine", S_EVENT_ENGINE, EVENT_ENGINE);
+  URING_ENTRIES = GetInt(keys, "UringEntries", 4096);
+  URING_BUF_COUNT = GetInt(keys, "UringBufCount", 4096);
+  URING_BUF_SIZE = GetInt(keys, "UringBufSize", 4096);
+
+  ZERO_COPY_THRESHOLD = GetInt(keys, "ZeroCopyThreshold", 0);
+
+  READ_SIZE_MAX = GetInt(keys, "ReadSizeMax", 65536);
+  READ_BUDGET = GetInt(keys, "ReadBudget", 262144);
+  READ_FIONREAD = GetInt(keys, "ReadFionread", 0);
+  BUFFER_SHRINK_SIZE = GetInt(keys, "BufferShrinkSize", 65536);
+
+  LAZY_BUFFERS = GetInt(keys, "LazyBuffers", 0);
+  BUFFER_POOL_MAX = GetInt(keys, "BufferPoolMax", 256);
+
+  WRITE_COALESCE = GetInt(keys, "WriteCoalesce", 0);
+
+  WBUF_HIGH_WATERMARK = GetInt(keys, "WbufHighWatermark", 0);
+  WBUF_LOW_WATERMARK = GetInt(keys, "WbufLowWatermark", 0);
+  WBUF_CONGEST_TIMEOUT = GetInt(keys, "WbufCongestTimeout", 1000);
+  S_WBUF_POLICY = "drop";
+  GetString(keys, "WbufPolicy", S_WBUF_POLICY, WBUF_POLICY);
+
+  S_DISPATCH_POLICY = "rr";
+  GetString(keys, "DispatchPolicy", S_DISPATCH_POLICY, DISPATCH_POLICY);
+
+  MIGRATE_THRESHOLD = GetInt(keys, "MigrateThreshold", 0);
+  MIGRATE_BATCH = GetInt(keys, "MigrateBatch", 16);
+
+  S_DISPATCH_CPUS = "";
+  GetString(keys, "DispatchCpus", S_DISPATCH_CPUS, DISPATCH_CPUS);
+  S_WORKER_CPUS = "";
+  GetString(keys, "WorkerCpus", S_WORKER_CPUS, WORKER_CPUS);
+  NUMA_BIND = GetInt(keys, "NumaBind", 0);
+  SCHED_FIFO_PRIO = GetInt(keys, "SchedFifo", 0);
+
+  BUSY_POLL = GetInt(keys, "BusyPoll", 0);
+  BUSY_POLL_SOCKET = GetInt(keys, "BusyPollSocket", 0);
+
+  UDP_PORT = GetInt(keys, "UdpPort", 0);
+  UDP_BATCH = GetInt(keys, "UdpBatch", 32);
+  UDP_PAYLOAD_MAX = GetInt(keys, "UdpPayloadMax", 1400);
+  UDP_RECV_SIZE = GetInt(keys, "UdpRecvSize", 4096);
 }
 
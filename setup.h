@@ -42,11 +42,19 @@ public:
 
 	int		LISTEN_PORT;
 	int		LISTEN_QUE_SIZE;
+	string	S_UNIX_SOCKET;		// "" none, "@name" abstract namespace
+	const char*	UNIX_SOCKET;
+	string	S_UNIX_SOCKET_MASK;	// octal
+	const char*	UNIX_SOCKET_MASK_STR;
+	int		UNIX_SOCKET_MASK;
 	int		MAX_EPOLL_SIZE;
 	int		MAX_CMD_THREAD_NUM;
 
 	int		CLIENT_RECV_TIMEOUT;
 	int		CLIENT_SEND_TIMEOUT;
+	int		CLIENT_IDLE_TIMEOUT;
+	int		TIMER_TICK;
+	int		CLOCK_TICK;
   
 	int		MAX_LOG_FILE_SIZE;
 	int		MAX_DEBUG_FILE_SIZE;
@@ -56,6 +64,58 @@ public:
 
   int   SUPPORT_IPV6;
   int   MAX_CONNS;
+
+  int   LISTEN_REUSEPORT;
+  int   REUSEPORT_STEERING;
+  int   ACCEPT_BURST;
+  int   THREAD_QUEUE_SIZE;
+  int   CONN_CACHE_PREWARM;
+  int   CONN_CACHE_MAX;
+
+  string  S_EVENT_ENGINE;
+  const char* EVENT_ENGINE;
+  int   URING_ENTRIES;
+  int   URING_BUF_COUNT;
+  int   URING_BUF_SIZE;
+
+  int   ZERO_COPY_THRESHOLD;
+
+  int   READ_SIZE_MAX;
+  int   READ_BUDGET;
+  int   READ_FIONREAD;
+  int   BUFFER_SHRINK_SIZE;
+
+  int   LAZY_BUFFERS;
+  int   BUFFER_POOL_MAX;
+
+  int   WRITE_COALESCE;
+
+  int   WBUF_HIGH_WATERMARK;
+  int   WBUF_LOW_WATERMARK;
+  int   WBUF_CONGEST_TIMEOUT;
+  string  S_WBUF_POLICY;
+  const char* WBUF_POLICY;
+
+  string  S_DISPATCH_POLICY;
+  const char* DISPATCH_POLICY;
+
+  int   MIGRATE_THRESHOLD;
+  int   MIGRATE_BATCH;
+
+  string  S_DISPATCH_CPUS;
+  const char* DISPATCH_CPUS;
+  string  S_WORKER_CPUS;
+  const char* WORKER_CPUS;
+  int   NUMA_BIND;
+  int   SCHED_FIFO_PRIO;
+
+  int   BUSY_POLL;
+  int   BUSY_POLL_SOCKET;
+
+  int   UDP_PORT;
+  int   UDP_BATCH;
+  int   UDP_PAYLOAD_MAX;
+  int   UDP_RECV_SIZE;
 };
 
 
@@ -0,0 +1,92 @@
+/*
+ * Per-accept cost: a client thread opens conns against the server in
+ * this process and holds them, then closes them and does it again. The
+ * server side CPU (process time minus the client thread) and the heap
+ * and RSS growth while the conns are held are divided by the conns.
+ *
+ *   accept_bench setup.txt [conns] [rounds]
+ */
+#include <malloc.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "bench_util.h"
+
+static int nconns = 1000;
+static int rounds = 5;
+
+static uint64_t process_cpu_usec() {
+  struct rusage ru;
+
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec +
+         ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec;
+}
+
+static uint64_t thread_cpu_usec() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static long rss_bytes() {
+  long pages = 0, rss = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+
+  if (f) {
+    if (fscanf(f, "%ld %ld", &pages, &rss) != 2)
+      rss = 0;
+    fclose(f);
+  }
+  return rss * sysconf(_SC_PAGESIZE);
+}
+
+static void *client(void *arg) {
+  vector<int> fds(nconns);
+  double      cpu_sum = 0;
+
+  for (int r = 0; r < rounds; r++) {
+    uint64_t target = bench_sum(&thread_stats::accepts) + nconns;
+    uint64_t cpu = process_cpu_usec(), mine = thread_cpu_usec();
+    size_t   heap = mallinfo2().uordblks;
+    long     rss = rss_bytes();
+
+    for (int i = 0; i < nconns; i++)
+      fds[i] = bench_connect(false);
+    while (bench_sum(&thread_stats::accepts) < target)
+      usleep(1000);
+
+    cpu = process_cpu_usec() - cpu - (thread_cpu_usec() - mine);
+    printf("round %d: %d conns, server cpu %.2f usec/accept, "
+           "heap %+.0f B/conn, rss %+.0f B/conn\n",
+           r, nconns, (double)cpu / nconns,
+           ((double)mallinfo2().uordblks - heap) / nconns,
+           ((double)rss_bytes() - rss) / nconns);
+    if (r > 0)
+      cpu_sum += (double)cpu / nconns;
+
+    for (int i = 0; i < nconns; i++)
+      close(fds[i]);
+    usleep(200000);
+  }
+
+  if (rounds > 1)
+    printf("sizeof(conn) %zu, server cpu %.2f usec/accept "
+           "over rounds 1..%d\n", sizeof(conn), cpu_sum / (rounds - 1),
+           rounds - 1);
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || !settings.Load(argv[1])) {
+    fprintf(stderr, "usage: %s setup.txt [conns] [rounds]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 2)
+    nconns = atoi(argv[2]);
+  if (argc > 3)
+    rounds = atoi(argv[3]);
+
+  return bench_run(bench_parse, client);
+}
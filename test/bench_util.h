@@ -0,0 +1,196 @@
+/*
+ * Shared by the benches in this directory: they run the server in their
+ * own process and drive it from a client thread over loopback.
+ */
+
+#ifndef __PS_BENCH_UTIL_INCLUDE__
+#define __PS_BENCH_UTIL_INCLUDE__
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "base_core.h"
+
+static Setup settings;
+
+/* echoes whatever arrived, the conn stays open */
+static inline enum try_parse_result bench_parse(conn *c) {
+  evbuffer_add_buffer(c->wbuf, c->rbuf);
+  c->keepalive = 1;
+  c->parse_to_go = conn_write;
+  return PARSE_OK;
+}
+
+/* field of thread_stats summed over the workers */
+static inline uint64_t bench_sum(uint64_t thread_stats::*field) {
+  uint64_t n = 0;
+
+  for (int i = 0; i < get_worker_thread_num(); i++)
+    n += __atomic_load_n(&(get_worker_thread(i)->stats.*field),
+                         __ATOMIC_RELAXED);
+  return n;
+}
+
+/* a conn to the bench server, the process exits if that fails */
+static inline int bench_connect(bool nodelay) {
+  struct sockaddr_in addr;
+  int                fd, one = 1;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(settings.LISTEN_PORT);
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror("connect");
+    exit(1);
+  }
+  if (nodelay)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  return fd;
+}
+
+/* same over the UnixSocket listener, '@' names are abstract */
+static inline int bench_connect_unix() {
+  struct sockaddr_un addr;
+  size_t             plen = strlen(settings.UNIX_SOCKET);
+  socklen_t          len;
+  int                fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (plen >= sizeof(addr.sun_path))
+    plen = sizeof(addr.sun_path) - 1;
+  memcpy(addr.sun_path, settings.UNIX_SOCKET, plen);
+  if (addr.sun_path[0] == '@')
+    addr.sun_path[0] = '\0';
+  len = offsetof(struct sockaddr_un, sun_path) + plen;
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, len) != 0) {
+    perror("connect");
+    exit(1);
+  }
+  return fd;
+}
+
+/*
+ * UDP sink on loopback for conns that only get pushed to, its address
+ * goes to addr. rcvbuf 0 leaves the buffer alone.
+ */
+static inline int bench_sink_open(struct sockaddr_in *addr, int rcvbuf) {
+  socklen_t len = sizeof(*addr);
+  int       fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (fd < 0 || bind(fd, (struct sockaddr *)addr, len) != 0 ||
+      getsockname(fd, (struct sockaddr *)addr, &len) != 0) {
+    perror("sink");
+    exit(1);
+  }
+  if (rcvbuf)
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf));
+  return fd;
+}
+
+/*
+ * A UDP socket connected to the sink, handed to the workers as a stream
+ * conn: one fd per conn instead of a TCP pair, and pushes still go
+ * through the write path. The sink sends it hello, its first request.
+ */
+static inline int bench_sink_conn(int sink, const struct sockaddr_in *sink_addr,
+                                  const char *hello) {
+  struct sockaddr_in addr = *sink_addr;
+  socklen_t          len = sizeof(addr);
+  int                fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+
+  addr.sin_port = 0;
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, len) != 0 ||
+      getsockname(fd, (struct sockaddr *)&addr, &len) != 0 ||
+      connect(fd, (struct sockaddr *)sink_addr, sizeof(*sink_addr)) != 0) {
+    perror("sink conn");
+    exit(1);
+  }
+  sendto(sink, hello, strlen(hello), 0, (struct sockaddr *)&addr, len);
+  dispatch_conn_new(fd, conn_new_req, EV_READ | EV_PERSIST, NULL);
+  return fd;
+}
+
+/* reads exactly len bytes, the process exits on EOF or an error */
+static inline void bench_read_full(int fd, char *buf, size_t len) {
+  for (size_t got = 0; got < len; ) {
+    ssize_t n = read(fd, buf + got, len - got);
+
+    if (n <= 0) {
+      perror("read");
+      exit(1);
+    }
+    got += n;
+  }
+}
+
+static inline uint64_t bench_nsec() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* prints p50/p99/p999 of samples, in usec; samples get sorted */
+static inline void bench_percentiles(const char *what,
+                                     vector<uint64_t> &samples) {
+  size_t n = samples.size();
+
+  if (!n)
+    return;
+  std::sort(samples.begin(), samples.end());
+  printf("  %s: %zu samples, p50 %.1f us, p99 %.1f us, p999 %.1f us, "
+         "max %.1f us\n", what, n, samples[n / 2] / 1e3,
+         samples[n * 99 / 100] / 1e3, samples[n * 999 / 1000] / 1e3,
+         samples[n - 1] / 1e3);
+}
+
+/*
+ * Starts the server from settings with parser, on UnixSocket too when
+ * set, and runs client in a thread of its own; client ends the process
+ * with exit() when done.
+ */
+static inline int bench_run(parse_request_pt parser,
+                            void *(*client)(void *)) {
+  pthread_t tid;
+
+  base_server_init(&settings);
+  set_request_parser(parser);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (server_socket(NULL, settings.LISTEN_PORT, settings.LISTEN_QUE_SIZE)) {
+    vperror("failed listen on tcp port %d", settings.LISTEN_PORT);
+    return 1;
+  }
+
+  if (settings.UNIX_SOCKET[0] &&
+      server_socket_unix(settings.UNIX_SOCKET, settings.UNIX_SOCKET_MASK,
+                         settings.LISTEN_QUE_SIZE)) {
+    vperror("failed listen on unix socket %s", settings.UNIX_SOCKET);
+    return 1;
+  }
+
+  pthread_create(&tid, NULL, client, NULL);
+  base_server_loop();
+  return 0;
+}
+
+#endif
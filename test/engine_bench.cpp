@@ -0,0 +1,74 @@
+/*
+ * Syscalls per request of the event engines. A client thread keeps conns
+ * busy with echo requests, one in flight per conn, against the server in
+ * this process. Reads, writes and io_uring_enter calls come from the
+ * thread stats, epoll_ctl too. epoll_wait and the eventfd reads of the
+ * doorbell and of io_uring completions happen inside libevent and are
+ * not counted; run under strace -f -c for those.
+ *
+ *   engine_bench setup.txt libevent|io_uring [conns] [rounds] [size]
+ */
+#include "bench_util.h"
+
+static int nconns = 64;
+static int rounds = 2000;
+static int req_size = 64;
+
+static void *client(void *arg) {
+  vector<int>  fds(nconns);
+  vector<char> req(req_size, 'x'), resp(req_size);
+  uint64_t     io, ctls, events, start, usec, nreqs;
+
+  for (int i = 0; i < nconns; i++)
+    fds[i] = bench_connect(true);
+  while (bench_sum(&thread_stats::accepts) < (uint64_t)nconns)
+    usleep(1000);
+  usleep(100000);
+
+  io = bench_sum(&thread_stats::io_syscalls);
+  ctls = bench_sum(&thread_stats::epoll_ctls);
+  events = bench_sum(&thread_stats::events);
+  start = Util::MonoUsec();
+
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < nconns; i++) {
+      if (write(fds[i], &req[0], req_size) != req_size) {
+        perror("write");
+        exit(1);
+      }
+    }
+    for (int i = 0; i < nconns; i++)
+      bench_read_full(fds[i], &resp[0], req_size);
+  }
+
+  usec = Util::MonoUsec() - start;
+  nreqs = (uint64_t)rounds * nconns;
+  io = bench_sum(&thread_stats::io_syscalls) - io;
+  ctls = bench_sum(&thread_stats::epoll_ctls) - ctls;
+  events = bench_sum(&thread_stats::events) - events;
+
+  printf("%s: %lu requests in %.1f ms, %.0f req/s\n",
+         get_worker_thread(0)->uring ? "io_uring" : "libevent",
+         (unsigned long)nreqs, usec / 1e3, nreqs / (usec / 1e6));
+  printf("  per request: io %.3f, epoll_ctl %.3f, total %.3f syscalls, "
+         "%.3f events\n", (double)io / nreqs, (double)ctls / nreqs,
+         (double)(io + ctls) / nreqs, (double)events / nreqs);
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3 || !settings.Load(argv[1])) {
+    fprintf(stderr, "usage: %s setup.txt libevent|io_uring "
+            "[conns] [rounds] [size]\n", argv[0]);
+    return 1;
+  }
+  settings.EVENT_ENGINE = argv[2];
+  if (argc > 3)
+    nconns = atoi(argv[3]);
+  if (argc > 4)
+    rounds = atoi(argv[4]);
+  if (argc > 5)
+    req_size = atoi(argv[5]);
+
+  return bench_run(bench_parse, client);
+}
@@ -0,0 +1,66 @@
+/*
+ * Memory held by idle conns, with buffers owned by every conn and with
+ * LazyBuffers. A client thread opens conns, makes one echo request on
+ * each so they have had traffic, and leaves them idle; the heap and RSS
+ * growth is divided by the conns.
+ *
+ *   idle_bench setup.txt eager|lazy [conns] [size]
+ */
+#include <malloc.h>
+
+#include "bench_util.h"
+
+static int nconns = 5000;
+static int req_size = 512;
+
+static long rss_bytes() {
+  long pages = 0, rss = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+
+  if (f) {
+    if (fscanf(f, "%ld %ld", &pages, &rss) != 2)
+      rss = 0;
+    fclose(f);
+  }
+  return rss * sysconf(_SC_PAGESIZE);
+}
+
+static void *client(void *arg) {
+  vector<int>  fds(nconns);
+  vector<char> req(req_size, 'x'), resp(req_size);
+  size_t       heap = mallinfo2().uordblks;
+  long         rss = rss_bytes();
+
+  for (int i = 0; i < nconns; i++) {
+    fds[i] = bench_connect(false);
+    if (write(fds[i], &req[0], req_size) != req_size) {
+      perror("write");
+      exit(1);
+    }
+    bench_read_full(fds[i], &resp[0], req_size);
+  }
+  /* let the workers finish with the last responses */
+  usleep(200000);
+
+  printf("%s: %d idle conns after a %d byte request, "
+         "heap %.0f B/conn, rss %.0f B/conn\n",
+         settings.LAZY_BUFFERS ? "lazy" : "eager", nconns, req_size,
+         ((double)mallinfo2().uordblks - heap) / nconns,
+         ((double)rss_bytes() - rss) / nconns);
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3 || !settings.Load(argv[1])) {
+    fprintf(stderr, "usage: %s setup.txt eager|lazy [conns] [size]\n",
+            argv[0]);
+    return 1;
+  }
+  settings.LAZY_BUFFERS = strcmp(argv[2], "lazy") == 0;
+  if (argc > 3)
+    nconns = atoi(argv[3]);
+  if (argc > 4)
+    req_size = atoi(argv[4]);
+
+  return bench_run(bench_parse, client);
+}
@@ -0,0 +1,66 @@
+/*
+ * Loopback ping-pong latency, blocking worker loops against BusyPoll.
+ * A client thread sends one small request at a time over a single conn
+ * and times each round trip; the worker's spin hits and sleeps come
+ * from the thread stats.
+ *
+ *   latency_bench setup.txt [BusyPoll usec] [rounds] [size]
+ */
+#include "bench_util.h"
+
+static int rounds = 20000;
+static int req_size = 32;
+
+static void *client(void *arg) {
+  int              fd = bench_connect(true);
+  vector<char>     req(req_size, 'x'), resp(req_size);
+  vector<uint64_t> rtts(rounds);
+  uint64_t         hits, sleeps;
+
+  /* warm up, the conn reaches its worker */
+  for (int r = 0; r < 100; r++) {
+    if (write(fd, &req[0], req_size) != req_size) {
+      perror("write");
+      exit(1);
+    }
+    bench_read_full(fd, &resp[0], req_size);
+  }
+
+  hits = bench_sum(&thread_stats::spin_hits);
+  sleeps = bench_sum(&thread_stats::spin_sleeps);
+
+  for (int r = 0; r < rounds; r++) {
+    uint64_t start = bench_nsec();
+
+    if (write(fd, &req[0], req_size) != req_size) {
+      perror("write");
+      exit(1);
+    }
+    bench_read_full(fd, &resp[0], req_size);
+    rtts[r] = bench_nsec() - start;
+  }
+
+  printf("BusyPoll=%d, %d round trips of %d bytes\n", settings.BUSY_POLL,
+         rounds, req_size);
+  bench_percentiles("rtt", rtts);
+  printf("  spin hits %lu, sleeps %lu\n",
+         (unsigned long)(bench_sum(&thread_stats::spin_hits) - hits),
+         (unsigned long)(bench_sum(&thread_stats::spin_sleeps) - sleeps));
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || !settings.Load(argv[1])) {
+    fprintf(stderr, "usage: %s setup.txt [BusyPoll usec] [rounds] [size]\n",
+            argv[0]);
+    return 1;
+  }
+  if (argc > 2)
+    settings.BUSY_POLL = atoi(argv[2]);
+  if (argc > 3)
+    rounds = atoi(argv[3]);
+  if (argc > 4)
+    req_size = atoi(argv[4]);
+
+  return bench_run(bench_parse, client);
+}
@@ -0,0 +1,124 @@
+/*
+ * Thread placement: round trip latency over many conns together with the
+ * NUMA allocation counters of the machine, for the WorkerCpus, NumaBind
+ * and SchedFifo of the setup file (or as given on the command line). A
+ * client thread writes a request on every conn, then reads the answers
+ * and times each from the start of the round. numa_miss and other_node
+ * are summed over /sys/devices/system/node and cover the whole machine,
+ * so run it on an otherwise quiet box.
+ *
+ *   numa_bench setup.txt [WorkerCpus] [NumaBind] [conns] [rounds]
+ */
+#include <ctype.h>
+#include <dirent.h>
+
+#include "bench_util.h"
+
+static int         nconns = 64;
+static int         rounds = 2000;
+static int         req_size = 64;
+static const char *worker_cpus;
+
+struct numa_counts {
+  uint64_t hit;
+  uint64_t miss;
+  uint64_t other;
+  int      nodes;
+};
+
+static void numa_read(numa_counts *counts) {
+  DIR           *dir = opendir("/sys/devices/system/node");
+  struct dirent *ent;
+  char           path[320], key[64];
+  unsigned long  val;
+
+  memset(counts, 0, sizeof(*counts));
+  if (!dir)
+    return;
+
+  while ((ent = readdir(dir)) != NULL) {
+    if (strncmp(ent->d_name, "node", 4) != 0 ||
+        !isdigit((unsigned char)ent->d_name[4]))
+      continue;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/%s/numastat",
+             ent->d_name);
+    FILE *f = fopen(path, "r");
+    if (!f)
+      continue;
+
+    counts->nodes++;
+    while (fscanf(f, "%63s %lu", key, &val) == 2) {
+      if (strcmp(key, "numa_hit") == 0)
+        counts->hit += val;
+      else if (strcmp(key, "numa_miss") == 0)
+        counts->miss += val;
+      else if (strcmp(key, "other_node") == 0)
+        counts->other += val;
+    }
+    fclose(f);
+  }
+  closedir(dir);
+}
+
+static void *client(void *arg) {
+  vector<int>      fds(nconns);
+  vector<char>     req(req_size, 'x'), resp(req_size);
+  vector<uint64_t> lats;
+  numa_counts      before, after;
+
+  for (int i = 0; i < nconns; i++)
+    fds[i] = bench_connect(true);
+  while (bench_sum(&thread_stats::accepts) < (uint64_t)nconns)
+    usleep(1000);
+  usleep(100000);
+
+  lats.reserve((size_t)rounds * nconns);
+  numa_read(&before);
+
+  for (int r = 0; r < rounds; r++) {
+    uint64_t start = bench_nsec();
+
+    for (int i = 0; i < nconns; i++) {
+      if (write(fds[i], &req[0], req_size) != req_size) {
+        perror("write");
+        exit(1);
+      }
+    }
+    for (int i = 0; i < nconns; i++) {
+      bench_read_full(fds[i], &resp[0], req_size);
+      lats.push_back(bench_nsec() - start);
+    }
+  }
+
+  numa_read(&after);
+
+  printf("WorkerCpus=%s NumaBind=%d SchedFifo=%d, %d conns, %d nodes\n",
+         worker_cpus ? worker_cpus : "", settings.NUMA_BIND,
+         settings.SCHED_FIFO_PRIO, nconns, after.nodes);
+  bench_percentiles("latency", lats);
+  printf("  numa_hit %lu, numa_miss %lu, other_node %lu pages\n",
+         (unsigned long)(after.hit - before.hit),
+         (unsigned long)(after.miss - before.miss),
+         (unsigned long)(after.other - before.other));
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || !settings.Load(argv[1])) {
+    fprintf(stderr, "usage: %s setup.txt [WorkerCpus] [NumaBind] "
+            "[conns] [rounds]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 2)
+    settings.WORKER_CPUS = argv[2];
+  if (argc > 3)
+    settings.NUMA_BIND = atoi(argv[3]);
+  if (argc > 4)
+    nconns = atoi(argv[4]);
+  if (argc > 5)
+    rounds = atoi(argv[5]);
+  worker_cpus = settings.WORKER_CPUS;
+
+  return bench_run(bench_parse, client);
+}
@@ -0,0 +1,83 @@
+/*
+ * Syscalls per request under pipelining, with and without
+ * WriteCoalesce. Every conn writes depth fixed size requests at once and
+ * reads the responses back; the server answers each one on its own.
+ * Reads and writes come from the thread stats.
+ *
+ *   pipeline_bench setup.txt plain|coalesce [conns] [depth] [rounds]
+ */
+#include "bench_util.h"
+
+static int nconns = 16;
+static int depth = 16;
+static int rounds = 1000;
+static int req_size = 32;
+
+/* one request is req_size bytes, echoed as its own response */
+static enum try_parse_result pipeline_parse(conn *c) {
+  if (evbuffer_get_length(c->rbuf) < (size_t)req_size)
+    return PARSE_NEED_MORE_DATA;
+
+  evbuffer_remove_buffer(c->rbuf, c->wbuf, req_size);
+  c->keepalive = 1;
+  c->parse_to_go = conn_write;
+  return PARSE_OK;
+}
+
+static void *client(void *arg) {
+  vector<int>  fds(nconns);
+  vector<char> reqs(req_size * depth, 'x'), resps(req_size * depth);
+  uint64_t     io, requests, coalesced, start, usec, nreqs;
+
+  for (int i = 0; i < nconns; i++)
+    fds[i] = bench_connect(true);
+  while (bench_sum(&thread_stats::accepts) < (uint64_t)nconns)
+    usleep(1000);
+  usleep(100000);
+
+  io = bench_sum(&thread_stats::io_syscalls);
+  requests = bench_sum(&thread_stats::requests);
+  coalesced = bench_sum(&thread_stats::writes_coalesced);
+  start = Util::MonoUsec();
+
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < nconns; i++) {
+      if (write(fds[i], &reqs[0], reqs.size()) != (ssize_t)reqs.size()) {
+        perror("write");
+        exit(1);
+      }
+    }
+    for (int i = 0; i < nconns; i++)
+      bench_read_full(fds[i], &resps[0], resps.size());
+  }
+
+  usec = Util::MonoUsec() - start;
+  nreqs = (uint64_t)rounds * nconns * depth;
+  io = bench_sum(&thread_stats::io_syscalls) - io;
+  requests = bench_sum(&thread_stats::requests) - requests;
+  coalesced = bench_sum(&thread_stats::writes_coalesced) - coalesced;
+
+  printf("%s: depth %d, %lu requests in %.1f ms, %.0f req/s\n",
+         settings.WRITE_COALESCE ? "coalesce" : "plain", depth,
+         (unsigned long)nreqs, usec / 1e3, nreqs / (usec / 1e6));
+  printf("  per request: %.3f read/write syscalls, %.3f coalesced\n",
+         (double)io / requests, (double)coalesced / requests);
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3 || !settings.Load(argv[1])) {
+    fprintf(stderr, "usage: %s setup.txt plain|coalesce "
+            "[conns] [depth] [rounds]\n", argv[0]);
+    return 1;
+  }
+  settings.WRITE_COALESCE = strcmp(argv[2], "coalesce") == 0;
+  if (argc > 3)
+    nconns = atoi(argv[3]);
+  if (argc > 4)
+    depth = atoi(argv[4]);
+  if (argc > 5)
+    rounds = atoi(argv[5]);
+
+  return bench_run(pipeline_parse, client);
+}
@@ -0,0 +1,89 @@
+/*
+ * Pub/sub fan-out: messages per second published to one topic, counted
+ * once the message reached every subscriber's socket. Subscribers are
+ * sink conns nobody reads, their hello subscribes them.
+ *
+ *   pubsub_bench setup.txt [subscribers] [messages] [size]
+ */
+#include <sys/resource.h>
+
+#include "bench_util.h"
+
+static int           nsubs = 10000;
+static int           nmsgs = 100;
+static int           msg_size = 64;
+static pubsub_topic *topic;
+
+static enum try_parse_result sub_parse(conn *c) {
+  evbuffer_drain(c->rbuf, evbuffer_get_length(c->rbuf));
+  pubsub_subscribe(c, topic);
+  c->keepalive = 1;
+  c->parse_to_go = conn_new_req;
+  return PARSE_OK;
+}
+
+static void *client(void *arg) {
+  struct sockaddr_in sink_addr;
+  vector<char>       msg(msg_size, 'm');
+  int                sink = bench_sink_open(&sink_addr, 0);
+  uint64_t           pushes, start, published, usec;
+  size_t             retries = 0;
+
+  /* topics are sized for the workers, which exist by now */
+  topic = pubsub_topic_get("bench");
+
+  for (int i = 0; i < nsubs; i++) {
+    bench_sink_conn(sink, &sink_addr, "s");
+
+    /* let the workers keep up, cq is bounded */
+    if (i % 1024 == 1023)
+      while (pubsub_subscribers(topic) + 256 < (size_t)i)
+        usleep(100);
+  }
+  while (pubsub_subscribers(topic) < (size_t)nsubs)
+    usleep(1000);
+
+  pushes = bench_sum(&thread_stats::pushes);
+  start = Util::MonoUsec();
+  for (int i = 0; i < nmsgs; i++) {
+    while (pubsub_publish(topic, &msg[0], msg.size()) < (size_t)nsubs)
+      retries++;
+  }
+  published = Util::MonoUsec() - start;
+  while (bench_sum(&thread_stats::pushes) - pushes < (uint64_t)nsubs * nmsgs)
+    usleep(100);
+  usec = Util::MonoUsec() - start;
+
+  printf("%d subscribers, %d messages of %d bytes: published in %.1f ms, "
+         "delivered in %.1f ms\n", nsubs, nmsgs, msg_size, published / 1e3,
+         usec / 1e3);
+  printf("  %.0f msgs/s, %.2f M deliveries/s, %zu publish retries\n",
+         nmsgs / (usec / 1e6), (double)nsubs * nmsgs / usec, retries);
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  struct rlimit rl;
+
+  if (argc < 2 || !settings.Load(argv[1])) {
+    fprintf(stderr, "usage: %s setup.txt [subscribers] [messages] [size]\n",
+            argv[0]);
+    return 1;
+  }
+  if (argc > 2)
+    nsubs = atoi(argv[2]);
+  if (argc > 3)
+    nmsgs = atoi(argv[3]);
+  if (argc > 4)
+    msg_size = atoi(argv[4]);
+
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)nsubs + 64) {
+    fprintf(stderr, "%d subscribers need %d fds, the limit is %lu\n",
+            nsubs, nsubs + 64, (unsigned long)rl.rlim_cur);
+    return 1;
+  }
+  if (settings.MAX_CONNS < nsubs + 16)
+    settings.MAX_CONNS = nsubs + 16;
+
+  return bench_run(sub_parse, client);
+}
@@ -0,0 +1,114 @@
+/*
+ * Push throughput of conn_push_batch against one conn_push_handle per
+ * message. A producer thread pushes batches of small messages to random
+ * conns, the messages are counted back at the sink all conns send to.
+ * Reported are the producer's rate, the rate until the last message
+ * arrived, and the doorbell wakeups it took.
+ *
+ *   push_batch_bench setup.txt single|batch [conns] [batches] [batch]
+ */
+#include "bench_util.h"
+
+static bool use_batch;
+static int  nconns = 1000;
+static int  nbatches = 50;
+static int  batch_size = 1000;
+
+enum { MSG_SIZE = 16 };
+
+/* the hello sets keepalive, pushes would close the conn otherwise */
+static enum try_parse_result hello_parse(conn *c) {
+  evbuffer_drain(c->rbuf, evbuffer_get_length(c->rbuf));
+  c->keepalive = 1;
+  c->parse_to_go = conn_new_req;
+  return PARSE_OK;
+}
+
+static void *client(void *arg) {
+  struct sockaddr_in    sink_addr;
+  int                   sink = bench_sink_open(&sink_addr, 64 << 20);
+  vector<int>           fds(nconns);
+  vector<conn_handle_t> handles(nconns);
+  vector<conn_push_msg> batch(batch_size);
+  char                  msg[MSG_SIZE], buf[65536];
+  uint64_t              wakeups, start, produced, delivered, idle, total;
+  uint64_t              bytes = 0, retries = 0;
+  unsigned              seed = 1;
+
+  memset(msg, 'm', sizeof(msg));
+  for (int i = 0; i < nconns; i++)
+    fds[i] = bench_sink_conn(sink, &sink_addr, "k");
+  while (bench_sum(&thread_stats::requests) < (uint64_t)nconns)
+    usleep(10000);
+  for (int i = 0; i < nconns; i++)
+    handles[i] = conn_handle_from_fd(fds[i]);
+
+  wakeups = bench_sum(&thread_stats::wakeups_issued);
+  start = Util::MonoUsec();
+
+  for (int b = 0; b < nbatches; b++) {
+    for (int i = 0; i < batch_size; i++) {
+      batch[i].handle = handles[rand_r(&seed) % nconns];
+      batch[i].data = msg;
+      batch[i].len = MSG_SIZE;
+      batch[i].queued = false;
+    }
+
+    if (use_batch && conn_push_batch(&batch[0], batch_size) == batch_size)
+      continue;
+
+    /* the single path, and what a batch could not queue */
+    for (int i = 0; i < batch_size; i++) {
+      while (!batch[i].queued &&
+             !conn_push_handle(batch[i].handle, batch[i].data, MSG_SIZE)) {
+        retries++;
+        sched_yield();
+      }
+    }
+  }
+  produced = Util::MonoUsec() - start;
+
+  total = (uint64_t)nbatches * batch_size * MSG_SIZE;
+  delivered = produced;
+  for (idle = Util::MonoUsec(); bytes < total &&
+       Util::MonoUsec() - idle < 3000000; ) {
+    ssize_t n = recv(sink, buf, sizeof(buf), MSG_DONTWAIT);
+
+    if (n <= 0) {
+      usleep(50);
+      continue;
+    }
+    bytes += n;
+    idle = Util::MonoUsec();
+    delivered = idle - start;
+  }
+
+  total /= MSG_SIZE;
+  printf("%s: %d conns, %d x %d msgs: producer %.0f kmsg/s, delivered "
+         "%.0f kmsg/s\n", use_batch ? "batch" : "single", nconns, nbatches,
+         batch_size, total / (produced / 1e3), total / (delivered / 1e3));
+  printf("  %lu of %lu msgs at the sink, %lu wakeups, %lu retries\n",
+         (unsigned long)(bytes / MSG_SIZE), (unsigned long)total,
+         (unsigned long)(bench_sum(&thread_stats::wakeups_issued) - wakeups),
+         (unsigned long)retries);
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 3 || !settings.Load(argv[1])) {
+    fprintf(stderr, "usage: %s setup.txt single|batch "
+            "[conns] [batches] [batch]\n", argv[0]);
+    return 1;
+  }
+  use_batch = strcmp(argv[2], "batch") == 0;
+  if (argc > 3)
+    nconns = atoi(argv[3]);
+  if (argc > 4)
+    nbatches = atoi(argv[4]);
+  if (argc > 5)
+    batch_size = atoi(argv[5]);
+  if (settings.MAX_CONNS < nconns + 16)
+    settings.MAX_CONNS = nconns + 16;
+
+  return bench_run(hello_parse, client);
+}
@@ -0,0 +1,122 @@
+/*
+ * Contention benchmark of the worker queues: producers hammer one
+ * consumer, through the old LockQueue (drained until pop() throws, as
+ * the worker loops did) and through MpscQueue (pop_batch, producers
+ * retry on a full ring).
+ *
+ *   queue_bench [producers] [items per producer] [capacity]
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "base_core.h"
+
+static int       nproducers = 4;
+static long      nitems = 1000000;
+static size_t    capacity = 8192;
+
+static LockQueue<long> lock_q;
+static MpscQueue<long> mpsc_q;
+static volatile int    started;
+
+static void *lock_producer(void *arg) {
+  while (!started)
+    sched_yield();
+  for (long i = 0; i < nitems; i++)
+    lock_q.push(i);
+  return NULL;
+}
+
+static void *mpsc_producer(void *arg) {
+  while (!started)
+    sched_yield();
+  for (long i = 0; i < nitems; i++) {
+    while (!mpsc_q.try_push(i))
+      sched_yield();
+  }
+  return NULL;
+}
+
+/*
+ * One drain pass per iteration, like a doorbell callback; the consumer
+ * yields when a pass found nothing, as a worker would go back to sleep.
+ */
+static long lock_consume(long total) {
+  long n = 0, drains = 0, last;
+
+  while (n < total) {
+    last = n;
+    try {
+      while (1) {
+        lock_q.pop();
+        n++;
+      }
+    } catch (std::exception &e) {
+      drains++;
+    }
+    if (n == last)
+      sched_yield();
+  }
+  return drains;
+}
+
+static long mpsc_consume(long total) {
+  long   buf[64];
+  long   n = 0, drains = 0;
+  size_t got;
+
+  while (n < total) {
+    long last = n;
+
+    while ((got = mpsc_q.pop_batch(buf, 64)) > 0)
+      n += got;
+    drains++;
+    if (n == last)
+      sched_yield();
+  }
+  return drains;
+}
+
+static void run(const char *name, void *(*producer)(void *),
+                long (*consume)(long)) {
+  vector<pthread_t> tids(nproducers);
+  long              total = nproducers * nitems, drains;
+  uint64_t          start, usec;
+
+  started = 0;
+  for (int i = 0; i < nproducers; i++)
+    pthread_create(&tids[i], NULL, producer, NULL);
+
+  start = Util::MonoUsec();
+  started = 1;
+  drains = consume(total);
+  usec = Util::MonoUsec() - start;
+
+  for (int i = 0; i < nproducers; i++)
+    pthread_join(tids[i], NULL);
+
+  printf("%-10s producers %d items %ld: %.1f ms, %.2f Mitems/s, "
+         "%.1f ns/item, %ld drains\n",
+         name, nproducers, total, usec / 1e3,
+         total / (double)usec, usec * 1e3 / total, drains);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    nproducers = atoi(argv[1]);
+  if (argc > 2)
+    nitems = atol(argv[2]);
+  if (argc > 3)
+    capacity = atol(argv[3]);
+
+  if (nproducers < 1 || nitems < 1 || !mpsc_q.init(capacity)) {
+    fprintf(stderr, "usage: %s [producers] [items] [capacity]\n", argv[0]);
+    return 1;
+  }
+
+  run("LockQueue", lock_producer, lock_consume);
+  run("MpscQueue", mpsc_producer, mpsc_consume);
+  return 0;
+}
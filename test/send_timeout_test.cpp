@@ -0,0 +1,155 @@
+/*
+ * ClientSendTimeout counts from the start of a send, not from the last
+ * write before an idle spell. A client idles longer than the timeout,
+ * then asks for a response the first write of which already fails, and
+ * reads it back late, but within the timeout: the conn has to survive.
+ * A conn that stops reading for longer than the timeout still has to be
+ * closed.
+ * ClientRecvTimeout is the shortest timeout, so conn timers fire every
+ * second and at least once while the first conn is blocked.
+ *
+ *   send_timeout_test setup.txt [libevent|io_uring]
+ */
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "base_core.h"
+
+static Setup  settings;
+static size_t big_size = 16 << 20;
+
+/*
+ * A request is answered with big_size bytes of 'b', after the socket
+ * buffers were filled with 'f' behind the server's back, as by an
+ * earlier response the client has not read yet.
+ */
+static enum try_parse_result test_parse(conn *c) {
+  vector<char> fill(4096, 'f'), resp(big_size, 'b');
+  int          sndbuf = fill.size();
+
+  evbuffer_drain(c->rbuf, evbuffer_get_length(c->rbuf));
+
+  /* a fixed size, the kernel would grow it again */
+  setsockopt(c->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  while (send(c->fd, &fill[0], fill.size(), MSG_DONTWAIT) > 0)
+    ;
+
+  evbuffer_add(c->wbuf, &resp[0], resp.size());
+  c->keepalive = 1;
+  c->parse_to_go = conn_write;
+  return PARSE_OK;
+}
+
+static uint64_t send_timeouts() {
+  uint64_t n = 0;
+
+  for (int i = 0; i < get_worker_thread_num(); i++)
+    n += __atomic_load_n(&get_worker_thread(i)->stats.send_timeouts,
+                         __ATOMIC_RELAXED);
+  return n;
+}
+
+static int test_connect() {
+  struct sockaddr_in addr;
+  int                fd, rcvbuf = 4096;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(settings.LISTEN_PORT);
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd >= 0)
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    perror("connect");
+    exit(1);
+  }
+  return fd;
+}
+
+/* 'b' bytes read before EOF or an error, the fill is skipped */
+static size_t read_big(int fd) {
+  vector<char> buf(1 << 16);
+  size_t       got = 0;
+  ssize_t      n;
+
+  while (got < big_size && (n = read(fd, &buf[0], buf.size())) > 0) {
+    for (ssize_t i = 0; i < n; i++)
+      got += buf[i] == 'b';
+  }
+  return got;
+}
+
+static void *client(void *arg) {
+  int    fd = test_connect();
+  size_t got;
+  int    failed = 0;
+
+  /* idle for longer than the send timeout */
+  usleep(3000000);
+
+  /* blocked on send from the first write, for 1.5s of the 2s */
+  if (write(fd, "b", 1) != 1) {
+    perror("write");
+    exit(1);
+  }
+  usleep(1500000);
+  got = read_big(fd);
+  printf("idle 3s, then blocked for 1.5s: %zu of %zu bytes, %s\n",
+         got, big_size,
+         got == big_size ? "ok" : "FAILED");
+  failed += got != big_size;
+  close(fd);
+
+  /* blocked past the timeout and the next timer run is closed */
+  uint64_t timeouts = send_timeouts();
+
+  fd = test_connect();
+  if (write(fd, "b", 1) != 1) {
+    perror("write");
+    exit(1);
+  }
+  usleep(3500000);
+  got = read_big(fd);
+  printf("blocked for 3.5s: %zu of %zu bytes, %lu send timeouts, %s\n",
+         got, big_size,
+         (unsigned long)(send_timeouts() - timeouts),
+         got < big_size && send_timeouts() > timeouts ? "ok" : "FAILED");
+  failed += !(got < big_size && send_timeouts() > timeouts);
+  close(fd);
+
+  exit(failed ? 1 : 0);
+}
+
+int main(int argc, char **argv) {
+  pthread_t tid;
+
+  if (argc < 2 || !settings.Load(argv[1])) {
+    fprintf(stderr, "usage: %s setup.txt [libevent|io_uring]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 2)
+    settings.EVENT_ENGINE = argv[2];
+  settings.CLIENT_SEND_TIMEOUT = 2;
+  settings.CLIENT_RECV_TIMEOUT = 1;
+  settings.CLIENT_IDLE_TIMEOUT = 0;
+
+  base_server_init(&settings);
+  set_request_parser(test_parse);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (server_socket(NULL, settings.LISTEN_PORT, settings.LISTEN_QUE_SIZE)) {
+    vperror("failed listen on tcp port %d", settings.LISTEN_PORT);
+    return 1;
+  }
+
+  pthread_create(&tid, NULL, client, NULL);
+  base_server_loop();
+  return 0;
+}
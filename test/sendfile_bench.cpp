@@ -0,0 +1,130 @@
+/*
+ * Large object throughput: every request returns the whole of a file,
+ * either queued with conn_add_file (sendfile, never in user space) or
+ * read into wbuf first, as handlers did before. A client thread fetches
+ * it over a few conns in the same process and reads it all back.
+ *
+ *   sendfile_bench setup.txt file|copy [MB] [conns] [rounds]
+ */
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "bench_util.h"
+
+static bool   use_file;
+static size_t file_size = 8 << 20;
+static int    nconns = 4;
+static int    rounds = 50;
+static char   path[] = "/tmp/sendfile_bench.XXXXXX";
+
+static enum try_parse_result file_parse(conn *c) {
+  int fd;
+
+  evbuffer_drain(c->rbuf, evbuffer_get_length(c->rbuf));
+  c->keepalive = 1;
+  c->parse_to_go = conn_write;
+
+  if ((fd = open(path, O_RDONLY)) < 0) {
+    perror("open");
+    c->keepalive = 0;
+    return PARSE_OK;
+  }
+
+  if (use_file) {
+    /* fd is closed once sent */
+    conn_add_file(c, fd, 0, -1, true);
+    return PARSE_OK;
+  }
+
+  struct evbuffer_iovec vec;
+  ssize_t n = 0;
+
+  if (evbuffer_reserve_space(c->wbuf, file_size, &vec, 1) == 1 &&
+      (n = pread(fd, vec.iov_base, file_size, 0)) > 0) {
+    vec.iov_len = n;
+    evbuffer_commit_space(c->wbuf, &vec, 1);
+  }
+  close(fd);
+  return PARSE_OK;
+}
+
+static bool make_file() {
+  vector<char> chunk(1 << 20);
+  int          fd = mkstemp(path);
+
+  if (fd < 0)
+    return false;
+  for (size_t i = 0; i < chunk.size(); i++)
+    chunk[i] = (char)i;
+  for (size_t done = 0; done < file_size; done += chunk.size()) {
+    size_t len = file_size - done < chunk.size() ? file_size - done
+                                                 : chunk.size();
+    if (write(fd, &chunk[0], len) != (ssize_t)len) {
+      close(fd);
+      return false;
+    }
+  }
+  close(fd);
+  return true;
+}
+
+static void *client(void *arg) {
+  vector<int>  fds(nconns);
+  vector<char> buf(1 << 20);
+  uint64_t     start, usec, bytes;
+
+  for (int i = 0; i < nconns; i++)
+    fds[i] = bench_connect(false);
+
+  start = Util::MonoUsec();
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < nconns; i++) {
+      if (write(fds[i], "g", 1) != 1) {
+        perror("write");
+        exit(1);
+      }
+    }
+    for (int i = 0; i < nconns; i++) {
+      for (size_t got = 0; got < file_size; got += buf.size()) {
+        size_t want = file_size - got < buf.size() ? file_size - got
+                                                   : buf.size();
+        bench_read_full(fds[i], &buf[0], want);
+      }
+    }
+  }
+  usec = Util::MonoUsec() - start;
+  bytes = (uint64_t)file_size * nconns * rounds;
+
+  printf("%s: %d x %zu MB over %d conns in %.1f ms, %.0f MB/s\n",
+         use_file ? "file" : "copy", rounds * nconns, file_size >> 20,
+         nconns, usec / 1e3, bytes / (double)usec);
+  unlink(path);
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  int rv;
+
+  if (argc < 3 || !settings.Load(argv[1])) {
+    fprintf(stderr, "usage: %s setup.txt file|copy [MB] [conns] [rounds]\n",
+            argv[0]);
+    return 1;
+  }
+  use_file = strcmp(argv[2], "file") == 0;
+  if (argc > 3)
+    file_size = (size_t)atoi(argv[3]) << 20;
+  if (argc > 4)
+    nconns = atoi(argv[4]);
+  if (argc > 5)
+    rounds = atoi(argv[5]);
+
+  if (!file_size || !make_file()) {
+    perror("can't create the test file");
+    return 1;
+  }
+
+  /* the client removes the file on success */
+  rv = bench_run(file_parse, client);
+  unlink(path);
+  return rv;
+}
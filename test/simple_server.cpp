@@ -76,6 +76,22 @@ int main(int argc, char **argv)
   }
 
   dlog1("listen port %d ...\n", settings.LISTEN_PORT);
+
+  if (settings.UNIX_SOCKET[0] &&
+      server_socket_unix(settings.UNIX_SOCKET,
+                         settings.UNIX_SOCKET_MASK,
+                         settings.LISTEN_QUE_SIZE))
+  {
+    vperror("failed listen on unix socket %s", settings.UNIX_SOCKET);
+    exit(1);
+  }
+
+  if (settings.UDP_PORT &&
+      server_socket_udp(NULL, settings.UDP_PORT))
+  {
+    vperror("failed listen on udp port %d", settings.UDP_PORT);
+    exit(1);
+  }
   
   PIDSaveToFile(settings.PID_FILE_PATH);
 
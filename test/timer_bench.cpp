@@ -0,0 +1,118 @@
+/*
+ * TimerWheel with a million timers: adding them, re-arming each one (a
+ * conn timer pushed back), and advancing the wheel until all fired,
+ * checking every one fires on its own tick. The same timers as libevent
+ * events, one per conn as the wheel replaced, for comparison; they are
+ * added, re-added and deleted but never run.
+ *
+ *   timer_bench [timers] [max ticks ahead]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "base_core.h"
+
+static long     ntimers = 1000000;
+static uint64_t max_ahead = 600;    /* ClientRecvTimeout=60, TimerTick=100 */
+
+static long     fired;
+static long     late;
+
+static void expired(timer_node *node, void *arg) {
+  TimerWheel *wheel = (TimerWheel *)arg;
+
+  fired++;
+  if (node->expire != wheel->now())
+    late++;
+}
+
+static void noop(int fd, short which, void *arg) {
+}
+
+static void report(const char *what, uint64_t usec) {
+  printf("  %-8s %8.1f ms %6.1f ns/timer\n", what, usec / 1e3,
+         usec * 1e3 / ntimers);
+}
+
+static void bench_wheel(const vector<uint64_t> &ahead) {
+  vector<timer_node> nodes(ntimers);
+  TimerWheel         wheel;
+  uint64_t           start;
+
+  memset(&nodes[0], 0, sizeof(timer_node) * ntimers);
+  wheel.init(0);
+  printf("TimerWheel, %ld timers up to %lu ticks ahead\n", ntimers,
+         (unsigned long)max_ahead);
+
+  start = Util::MonoUsec();
+  for (long i = 0; i < ntimers; i++)
+    wheel.add(&nodes[i], ahead[i]);
+  report("add", Util::MonoUsec() - start);
+
+  start = Util::MonoUsec();
+  for (long i = 0; i < ntimers; i++)
+    wheel.add(&nodes[i], ahead[ntimers - 1 - i]);
+  report("re-arm", Util::MonoUsec() - start);
+
+  start = Util::MonoUsec();
+  for (uint64_t now = 1; wheel.size() > 0; now++)
+    wheel.advance(now, expired, &wheel);
+  report("expire", Util::MonoUsec() - start);
+
+  printf("  %ld fired, %ld off their tick\n", fired, late);
+}
+
+static void bench_libevent(const vector<uint64_t> &ahead) {
+  struct event_base *base = event_base_new();
+  vector<event>      events(ntimers);
+  struct timeval     tv;
+  uint64_t           start;
+
+  printf("libevent timers, one event each\n");
+
+  start = Util::MonoUsec();
+  for (long i = 0; i < ntimers; i++) {
+    evtimer_assign(&events[i], base, noop, NULL);
+    tv.tv_sec = ahead[i] / 10;
+    tv.tv_usec = ahead[i] % 10 * 100000;
+    evtimer_add(&events[i], &tv);
+  }
+  report("add", Util::MonoUsec() - start);
+
+  start = Util::MonoUsec();
+  for (long i = 0; i < ntimers; i++) {
+    tv.tv_sec = ahead[ntimers - 1 - i] / 10;
+    tv.tv_usec = ahead[ntimers - 1 - i] % 10 * 100000;
+    evtimer_add(&events[i], &tv);
+  }
+  report("re-arm", Util::MonoUsec() - start);
+
+  start = Util::MonoUsec();
+  for (long i = 0; i < ntimers; i++)
+    evtimer_del(&events[i]);
+  report("del", Util::MonoUsec() - start);
+
+  event_base_free(base);
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    ntimers = atol(argv[1]);
+  if (argc > 2)
+    max_ahead = strtoull(argv[2], NULL, 10);
+
+  if (ntimers < 1 || max_ahead < 1) {
+    fprintf(stderr, "usage: %s [timers] [max ticks ahead]\n", argv[0]);
+    return 1;
+  }
+
+  vector<uint64_t> ahead(ntimers);
+
+  srandom(1);
+  for (long i = 0; i < ntimers; i++)
+    ahead[i] = 1 + random() % max_ahead;
+
+  bench_wheel(ahead);
+  bench_libevent(ahead);
+  return fired == ntimers && late == 0 ? 0 : 1;
+}
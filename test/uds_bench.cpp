@@ -0,0 +1,74 @@
+/*
+ * TCP loopback against a Unix domain socket, on the same echo server:
+ * round trip latency of small requests over one conn, then the
+ * throughput of large requests echoed back over one conn.
+ *
+ *   uds_bench setup.txt [rounds] [size] [MB]
+ */
+#include "bench_util.h"
+
+static int    rounds = 20000;
+static int    req_size = 32;
+static size_t bulk_mb = 256;
+
+static void ping_pong(int fd, const char *what) {
+  vector<char>     req(req_size, 'x'), resp(req_size);
+  vector<uint64_t> rtts(rounds);
+
+  for (int r = 0; r < rounds; r++) {
+    uint64_t start = bench_nsec();
+
+    if (write(fd, &req[0], req_size) != req_size) {
+      perror("write");
+      exit(1);
+    }
+    bench_read_full(fd, &resp[0], req_size);
+    rtts[r] = bench_nsec() - start;
+  }
+  bench_percentiles(what, rtts);
+}
+
+static void bulk(int fd, const char *what) {
+  vector<char> buf(64 << 10, 'x');
+  uint64_t     start = bench_nsec(), nsec;
+  size_t       n = (bulk_mb << 20) / buf.size();
+
+  for (size_t i = 0; i < n; i++) {
+    if (write(fd, &buf[0], buf.size()) != (ssize_t)buf.size()) {
+      perror("write");
+      exit(1);
+    }
+    bench_read_full(fd, &buf[0], buf.size());
+  }
+  nsec = bench_nsec() - start;
+  printf("  %s: %zu MB echoed in 64 KB requests, %.0f MB/s\n", what,
+         n * buf.size() >> 20, (n * buf.size() >> 20) / (nsec / 1e9));
+}
+
+static void *client(void *arg) {
+  int tcp = bench_connect(true), uds = bench_connect_unix();
+
+  printf("%d round trips of %d bytes\n", rounds, req_size);
+  ping_pong(tcp, "tcp");
+  ping_pong(uds, "uds");
+  bulk(tcp, "tcp");
+  bulk(uds, "uds");
+  exit(0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2 || !settings.Load(argv[1])) {
+    fprintf(stderr, "usage: %s setup.txt [rounds] [size] [MB]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 2)
+    rounds = atoi(argv[2]);
+  if (argc > 3)
+    req_size = atoi(argv[3]);
+  if (argc > 4)
+    bulk_mb = atol(argv[4]);
+  if (!settings.UNIX_SOCKET[0])
+    settings.UNIX_SOCKET = "@mcd_uds_bench";
+
+  return bench_run(bench_parse, client);
+}
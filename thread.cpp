@@ -5,19 +5,34 @@
  */
 
 #include <pthread.h>
+#include <dirent.h>
+#include <sys/syscall.h>
 #include <vector>
 
 #include "util.h"
 #include "thread.h"
+#include "uring.h"
+#include "udp.h"
+#include "pubsub.h"
 #include "log.h"
 
 using namespace std;
 
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+
+#define NUMA_MAX_NODES 1024
+
 /* Connection lock around accepting new connections */
 pthread_mutex_t conn_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static vector<LibeventThread*> threads;
 static LibeventThread dispatch_thread;
+static __thread LibeventThread *current_thread;  /* event loop of this thread */
 
 /*
  * Number of worker threads that have finished setting themselves up.
@@ -26,52 +41,84 @@ static int init_count;
 static pthread_mutex_t init_lock;
 static pthread_cond_t init_cond;
 
+LibeventThread::~LibeventThread() {
+  conn_zc_sweep(this, true);
+  delete uring;
+  udp_batch_free(udp);
+  for (size_t i = 0; i < rbuf_pool.size(); i++)
+    evbuffer_free(rbuf_pool[i]);
+  for (size_t i = 0; i < wbuf_pool.size(); i++)
+    evbuffer_free(wbuf_pool[i]);
+  free(scratch);
+  if (_base)
+    event_base_free(_base);
+  if (_doorbell_fd >= 0)
+    close(_doorbell_fd);
+}
+
 bool LibeventThread::init() {
-  int fds[2];
-  if (pipe(fds)) {
-      perror("Can't create notify pipe");
-      return false;
+  _self = pthread_self();
+  _doorbell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_doorbell_fd < 0) {
+    perror("Can't create doorbell eventfd");
+    return false;
   }
 
-  _notify_receive_fd = fds[0];
-  _notify_send_fd = fds[1];
-  evutil_make_socket_nonblocking(_notify_receive_fd);
-  evutil_make_socket_nonblocking(_notify_send_fd);
-
-  if (pipe(fds)) {
-    perror("Can't create notify pipe");
+  if (!cq.init(base_conf.thread_queue_size) ||
+      !push_q.init(base_conf.thread_queue_size)) {
+    dlog4("Can't allocate thread queues\n");
     return false;
   }
 
-  _push_receive_fd = fds[0];
-  _push_send_fd = fds[1];
-  evutil_make_socket_nonblocking(_push_receive_fd);
-  evutil_make_socket_nonblocking(_push_send_fd);
-  
   _base = event_init(); 
   if (!_base) {
     dlog4("Can't allocate event base\n");
     return false;
   }
 
-  /* Listen for notifications from other threads */
-  event_set(&_notify_event, _notify_receive_fd,
-            EV_READ | EV_PERSIST, thread_libevent_process, this);
-  event_base_set(_base, &_notify_event);
+  /* Listen for new connections and pushes from other threads */
+  event_set(&_doorbell_event, _doorbell_fd,
+            EV_READ | EV_PERSIST, thread_doorbell_process, this);
+  event_base_set(_base, &_doorbell_event);
 
-  if (event_add(&_notify_event, 0) == -1) {
-    dlog4("Can't monitor libevent notify pipe\n");
+  if (event_add(&_doorbell_event, 0) == -1) {
+    dlog4("Can't monitor libevent doorbell\n");
     return false;
   }
 
-  /* Listen for notifications from other connections */
-  event_set(&_push_event, _push_receive_fd,
-            EV_READ | EV_PERSIST, thread_push_event_process, this);
-  event_base_set(_base, &_push_event);
+  /* the timer also frees lingering zerocopy buffers */
+  if (base_conf.timeout_min || base_conf.zerocopy_threshold) {
+    struct timeval tv;
 
-  if (event_add(&_push_event, 0) == -1) {
-    dlog4("Can't monitor libevent push pipe\n");
-    return false;
+    tv.tv_sec = base_conf.timer_tick / 1000;
+    tv.tv_usec = (base_conf.timer_tick % 1000) * 1000;
+    timers.init(current_msec / base_conf.timer_tick);
+
+    event_set(&_timer_event, -1, EV_PERSIST, thread_timer_process, this);
+    event_base_set(_base, &_timer_event);
+    if (event_add(&_timer_event, &tv) == -1) {
+      dlog4("Can't add timer event\n");
+      return false;
+    }
+  }
+
+  if (base_conf.lazy_buffers) {
+    scratch_size = base_conf.read_size_max;
+    scratch = (char *)malloc(scratch_size);
+    if (!scratch) {
+      dlog4("Can't allocate read scratch buffer\n");
+      return false;
+    }
+  }
+
+  if (base_conf.event_engine == ENGINE_URING) {
+    uring = new Uring(this);
+    if (!uring->init(base_conf.uring_entries, base_conf.uring_bufs,
+                     base_conf.uring_bufsize)) {
+      fprintf(stderr, "io_uring is not usable, falling back to libevent\n");
+      delete uring;
+      uring = NULL;
+    }
   }
 
   return true;
@@ -81,99 +128,269 @@ bool LibeventThread::stop() {
   if (!_base)
     return false;
 
+  __atomic_store_n(&_stopping, 1, __ATOMIC_RELEASE);
   return 0 == event_base_loopbreak(_base);
 }
 
+/*
+ * Points the allocations of the calling thread at the NUMA nodes of the
+ * cpus it is pinned to (sysfs lists a cpu's node as a nodeN entry).
+ * Conn slabs and evbuffers a worker allocates from then on are local.
+ */
+static void thread_numa_bind(const cpu_set_t *cpus) {
+  unsigned long  nodes[NUMA_MAX_NODES / (8 * sizeof(unsigned long))];
+  char           path[64];
+  struct dirent *ent;
+  DIR           *dir;
+  int            node, first = -1;
+
+  memset(nodes, 0, sizeof(nodes));
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, cpus))
+      continue;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    if (!(dir = opendir(path)))
+      continue;
+    while ((ent = readdir(dir))) {
+      if (sscanf(ent->d_name, "node%d", &node) == 1 &&
+          node >= 0 && node < NUMA_MAX_NODES) {
+        nodes[node / (8 * sizeof(unsigned long))] |=
+            1UL << (node % (8 * sizeof(unsigned long)));
+        if (first < 0 || node < first)
+          first = node;
+      }
+    }
+    closedir(dir);
+  }
+
+  if (first < 0) {
+    dlog1("no NUMA node found for the worker cpus\n");
+    return;
+  }
+
+  /* preferred takes one node, the lowest one of the set */
+  if (base_conf.numa_bind == NUMA_PREFERRED) {
+    memset(nodes, 0, sizeof(nodes));
+    nodes[first / (8 * sizeof(unsigned long))] =
+        1UL << (first % (8 * sizeof(unsigned long)));
+  }
+
+  /* maxnode is one more than the bits the kernel reads */
+  if (syscall(SYS_set_mempolicy,
+              base_conf.numa_bind == NUMA_STRICT ? MPOL_BIND : MPOL_PREFERRED,
+              nodes, (unsigned long)NUMA_MAX_NODES + 1) != 0)
+    perror("set_mempolicy");
+}
+
 int LibeventThread::do_thread_func() {
+  _self = pthread_self();
+  current_thread = this;
+
+  if (base_conf.numa_bind && get_affinity())
+    thread_numa_bind(get_affinity());
+
+  if (base_conf.nthreads > 0)
+    conn_cache_prewarm(this, base_conf.conn_cache_prewarm / base_conf.nthreads);
 
   pthread_mutex_lock(&init_lock);
   init_count++;
   pthread_cond_signal(&init_cond);
   pthread_mutex_unlock(&init_lock);
   
-  event_base_loop(this->get_event_base(), 0);
+  if (base_conf.busy_poll)
+    busy_loop();
+  else
+    event_base_loop(this->get_event_base(), 0);
   return 0;
 }
 
-void LibeventThread::thread_libevent_process(int fd,
+/*
+ * BusyPoll mode: after any work the thread keeps polling for BusyPoll
+ * usec before it sleeps, trading a cpu for the epoll_wait wakeup. A poll
+ * is one non-blocking loop iteration plus a look at cq and push_q; the
+ * doorbell stays disarmed meanwhile, producers skip the eventfd write.
+ * Once the window passes idle the doorbell is armed again and the thread
+ * blocks until the next event.
+ */
+void LibeventThread::busy_loop() {
+  uint64_t until = Util::MonoUsec() + base_conf.busy_poll;
+  bool     idle = false;
+
+  __atomic_store_n(&_doorbell_armed, 0, __ATOMIC_SEQ_CST);
+
+  while (!__atomic_load_n(&_stopping, __ATOMIC_ACQUIRE)) {
+    uint64_t events = stats.events;
+    bool     work = false;
+
+    /* the doorbell callback re-arms it */
+    if (__atomic_load_n(&_doorbell_armed, __ATOMIC_RELAXED))
+      __atomic_store_n(&_doorbell_armed, 0, __ATOMIC_SEQ_CST);
+
+    if (cq.can_pop() || push_q.can_pop()) {
+      drain_cq();
+      drain_push_q();
+      work = true;
+    }
+
+    event_base_loop(_base, EVLOOP_NONBLOCK);
+
+    if (work || stats.events != events) {
+      if (idle)
+        stats.spin_hits++;
+      idle = false;
+      until = Util::MonoUsec() + base_conf.busy_poll;
+      continue;
+    }
+
+    idle = true;
+    if (Util::MonoUsec() < until)
+      continue;
+
+    /* same dance as thread_doorbell_process: arm, then look again */
+    __atomic_store_n(&_doorbell_armed, 1, __ATOMIC_SEQ_CST);
+    if (cq.can_pop() || push_q.can_pop())
+      continue;
+
+    stats.spin_sleeps++;
+    event_base_loop(_base, EVLOOP_ONCE);
+    __atomic_store_n(&_doorbell_armed, 0, __ATOMIC_SEQ_CST);
+    idle = false;
+    until = Util::MonoUsec() + base_conf.busy_poll;
+  }
+}
+
+void LibeventThread::thread_doorbell_process(int fd,
                                              short which,
                                              void *arg) {
   LibeventThread *me = (LibeventThread*)arg; 
-  cq_item item;
-  char buf[1024];
+  uint64_t count;
 
-  /*
-  if (read(fd, buf, 1) != 1) {
-    dlog4("Can't read from libevent pipe\n");
+  if (read(fd, &count, sizeof(count)) != sizeof(count) && errno != EAGAIN) {
+    dlog4("Can't read from doorbell\n");
   }
-  */
 
-  while (read(fd, buf, sizeof(buf)) > 0)
-    ;
- 
+  int want = __atomic_exchange_n(&me->migrate_want, 0, __ATOMIC_ACQUIRE);
+  if (want)
+    conn_migrate_some(me, me->migrate_to, want);
+
   while (1) {
-    try {
-      item = me->cq.pop();
-      conn *c = conn_new(item.sfd, item.init_state, item.event_flags,
-                         me);
-      if (c == NULL) {
-        dlog4("Can't listen for events on fd %d\n", item.sfd);
-        close(item.sfd); 
-      }
-      
-      char ntop[NI_MAXHOST];
-      char strport[NI_MAXSERV];
-      int ni_rv;
-
-      ni_rv = getnameinfo((struct sockaddr *)&item.addr, sizeof(item.addr),
-          ntop, sizeof(ntop), strport, sizeof(strport),
-          NI_NUMERICHOST|NI_NUMERICSERV);
-   
-      if (ni_rv != 0) {
-        perror("getnameinfo");
-        ntop[0] = 0;
-        strport[0] = 0;
-      } else {
-        c->host->assign(ntop);
-        c->port = atoi(strport);
-      }
-      
-      dlog4("conn_new conn fd:%d, (%s:%s) cq:%lu\n", item.sfd, ntop, strport, me->cq.size());
-      
-    } catch (const std::exception e) {
+    me->drain_cq();
+    me->drain_push_q();
+
+    /*
+     * Re-arm, then look again: anything queued before a producer saw the
+     * armed flag has to be picked up here. If the flag is already gone a
+     * producer has rung and this callback runs again anyway.
+     */
+    __atomic_store_n(&me->_doorbell_armed, 1, __ATOMIC_SEQ_CST);
+    if (!me->cq.can_pop() && !me->push_q.can_pop())
       break;
+    if (!__atomic_exchange_n(&me->_doorbell_armed, 0, __ATOMIC_SEQ_CST))
+      break;
+  }
+}
+
+void LibeventThread::thread_timer_process(int fd, short which, void *arg) {
+  LibeventThread *me = (LibeventThread*)arg;
+
+  me->timers.advance(current_msec / base_conf.timer_tick,
+                     conn_timer_expired, me);
+  if (me->zc_linger)
+    conn_zc_sweep(me, false);
+}
+
+void LibeventThread::drain_cq() {
+  cq_item items[MAX_ACCEPT_BURST];
+  size_t  n;
+
+  while ((n = cq.pop_batch(items, MAX_ACCEPT_BURST)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      conn_new_from_item(items[i]);
+      dlog4("conn_new conn fd:%d, cq:%lu\n", items[i].sfd, cq.size());
     }
   }
 }
 
-void LibeventThread::thread_push_event_process(int fd,
-                                               short which,
-                                               void *arg) {
-  LibeventThread *me = (LibeventThread*)arg; 
-  int  conn_fd;
-  char buf[1024];
+void LibeventThread::conn_new_from_item(const cq_item &item) {
+  conn *c = conn_new(item.sfd, item.init_state, item.event_flags, this);
+  if (c == NULL) {
+    dlog4("Can't listen for events on fd %d\n", item.sfd);
+    close(item.sfd); 
+    return;
+  }
 
-  /*
-  if (read(fd, buf, 1) != 1) {
-    dlog4("Can't read from libevent pipe\n");
+  stats.accepts++;
+
+  if (item.accept_usec) {
+    uint64_t lat = Util::MonoUsec() - item.accept_usec;
+    stats.accept_lat_usec += lat;
+    if (lat > stats.accept_lat_max_usec)
+      stats.accept_lat_max_usec = lat;
   }
-  */
 
-  while (read(fd, buf, sizeof(buf)) > 0)
-    ;
+  if (item.addr.ss_family != AF_UNSPEC)
+    conn_set_peer(c, (const struct sockaddr *)&item.addr, sizeof(item.addr));
+}
+
+void LibeventThread::drain_push_q() {
+  push_item item;
 
-  while (1) {
-    try {
-      conn_fd = me->push_q.pop();
-      conn *c = conn_from_fd(conn_fd);
-      if (c) {
-        c->push_event_handler(fd, which, (void*)c);
-      } else {
-        dlog4("push conn fd %d is closed\n", conn_fd);
-      }
-    } catch (const std::exception e) {
-      break;
-    }
+  while (push_q.try_pop(item))
+    push_process(item);
+}
+
+void LibeventThread::push_process(const push_item &item) {
+  if (item.msg) {
+    pubsub_deliver(this, item.topic, item.msg);
+    return;
+  }
+
+  conn *c = conn_from_handle(item.handle);
+
+  if (!c) {
+    dlog4("push conn fd %d is closed\n", CONN_HANDLE_FD(item.handle));
+    stats.push_stale++;
+    if (item.buf)
+      evbuffer_free(item.buf);
+    return;
+  }
+
+  if (item.migrate) {
+    stats.migrations_in++;
+    conn_adopt(c);
+    return;
+  }
+
+  if (conn_push_receive(c, item.buf))
+    c->push_event_handler(c->fd, EV_WRITE, (void*)c);
+}
+
+static int dispatch_rr(const cq_item *item, int nthreads);
+static int dispatch_least_conns(const cq_item *item, int nthreads);
+static int dispatch_p2c(const cq_item *item, int nthreads);
+static int dispatch_ip_hash(const cq_item *item, int nthreads);
+
+/*
+ * The dispatch thread is the main thread. It is placed last so that the
+ * workers don't inherit DispatchCpus or SchedFifo; threads the server
+ * creates after base_server_init do, see test/setup.txt. The memory
+ * policy of NumaBind is set by each worker for itself only.
+ */
+static void thread_place_dispatch() {
+  struct sched_param param;
+  int                ret;
+
+  if (base_conf.dispatch_pinned &&
+      (ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                                    &base_conf.dispatch_cpus)) != 0)
+    fprintf(stderr, "Can't pin dispatch thread: %s\n", strerror(ret));
+
+  if (base_conf.sched_fifo) {
+    param.sched_priority = base_conf.sched_fifo;
+    if ((ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+      fprintf(stderr, "Can't use SCHED_FIFO: %s\n", strerror(ret));
   }
 }
 
@@ -184,11 +401,30 @@ void thread_init() {
  
   if (!dispatch_thread.init())
     exit(1);
+  current_thread = &dispatch_thread;
+
+  switch (base_conf.dispatch_policy) {
+  case DISPATCH_LEAST_CONNS:
+    set_dispatch_policy(dispatch_least_conns);
+    break;
+  case DISPATCH_P2C:
+    set_dispatch_policy(dispatch_p2c);
+    break;
+  case DISPATCH_IP_HASH:
+    set_dispatch_policy(dispatch_ip_hash);
+    break;
+  default:
+    set_dispatch_policy(dispatch_rr);
+  }
 
   for (int i = 0; i < base_conf.nthreads; i++) {
     LibeventThread *thread = new LibeventThread();
+    thread->id = i;
     if (!thread->init())
       exit(1);
+    if (base_conf.nworker_cpus)
+      thread->set_affinity(&base_conf.worker_cpus[i % base_conf.nworker_cpus]);
+    thread->set_sched_fifo(base_conf.sched_fifo);
     thread->create(); 
     threads.push_back(thread);     
   }
@@ -199,6 +435,8 @@ void thread_init() {
       pthread_cond_wait(&init_cond, &init_lock);
   }
   pthread_mutex_unlock(&init_lock);
+
+  thread_place_dispatch();
 }
 
 void thread_stop() {
@@ -213,7 +451,167 @@ void thread_stop() {
   threads.clear();
 }
 
-static int last_thread = -1;
+/* rebalancer: seconds between two moves, least load worth balancing */
+#define MIGRATE_INTERVAL 5
+#define MIGRATE_MIN_LOAD 100
+
+static unsigned last_thread = 0;
+
+/* conns dispatch_conn_batch has assigned but not queued yet */
+static vector<vector<cq_item> > groups;
+
+static int dispatch_rr(const cq_item *item, int nthreads) {
+  return __sync_fetch_and_add(&last_thread, 1) % nthreads;
+}
+
+/*
+ * Connections a worker holds or is about to: live ones, the ones in its
+ * cq and the ones of the batch being dispatched. Safe from any thread;
+ * the pending batch belongs to the dispatch thread and only counts there.
+ */
+int dispatch_conns(int tid) {
+  LibeventThread *thread = threads[tid];
+  int n = __atomic_load_n(&thread->nconns, __ATOMIC_RELAXED) + thread->cq.size();
+
+  if (dispatch_thread.in_thread() && (size_t)tid < groups.size())
+    n += groups[tid].size();
+  return n;
+}
+
+static int dispatch_least_conns(const cq_item *item, int nthreads) {
+  int best = dispatch_rr(item, nthreads);
+  int best_n = dispatch_conns(best);
+
+  /* start at a round-robin point, ties don't always hit worker 0 */
+  for (int i = 1; i < nthreads; i++) {
+    int tid = (best + i) % nthreads;
+    int n = dispatch_conns(tid);
+    if (n < best_n) {
+      best = tid;
+      best_n = n;
+    }
+  }
+  return best;
+}
+
+/*
+ * Power of two choices: two random workers, the less loaded one wins.
+ * Load is the smoothed request rate, conns break ties (idle long lived
+ * conns weigh in nothing else).
+ */
+static int dispatch_p2c(const cq_item *item, int nthreads) {
+  static __thread unsigned seed;
+  int a, b;
+
+  if (!seed)
+    seed = (unsigned)pthread_self() ^ (unsigned)current_usec;
+
+  a = rand_r(&seed) % nthreads;
+  b = rand_r(&seed) % nthreads;
+  if (a == b)
+    return a;
+
+  uint32_t la = __atomic_load_n(&threads[a]->load, __ATOMIC_RELAXED);
+  uint32_t lb = __atomic_load_n(&threads[b]->load, __ATOMIC_RELAXED);
+  if (la != lb)
+    return la < lb ? a : b;
+  return dispatch_conns(a) <= dispatch_conns(b) ? a : b;
+}
+
+/* same client address, same worker; unknown peers go round-robin */
+static int dispatch_ip_hash(const cq_item *item, int nthreads) {
+  const unsigned char *p;
+  size_t   len;
+  uint32_t h = 2166136261u;
+
+  if (item->addr.ss_family == AF_INET) {
+    p = (const unsigned char *)&((const sockaddr_in *)&item->addr)->sin_addr;
+    len = 4;
+  } else if (item->addr.ss_family == AF_INET6) {
+    p = (const unsigned char *)&((const sockaddr_in6 *)&item->addr)->sin6_addr;
+    len = 16;
+  } else {
+    return dispatch_rr(item, nthreads);
+  }
+
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ p[i]) * 16777619u;
+  return h % nthreads;
+}
+
+static dispatch_policy_pt dispatch_policy = dispatch_rr;
+
+void set_dispatch_policy(dispatch_policy_pt policy) {
+  dispatch_policy = policy ? policy : dispatch_rr;
+}
+
+static int dispatch_pick(const cq_item *item) {
+  int tid = dispatch_policy(item, base_conf.nthreads);
+
+  if (tid < 0 || tid >= base_conf.nthreads)
+    tid = dispatch_rr(item, base_conf.nthreads);
+  return tid;
+}
+
+/*
+ * Once a second from the main clock: request and push rate of every
+ * worker, smoothed over a few seconds (new = 3/4 old + 1/4 rate).
+ */
+void thread_update_load() {
+  for (size_t i = 0; i < threads.size(); i++) {
+    LibeventThread *thread = threads[i];
+    uint64_t reqs = __atomic_load_n(&thread->stats.requests, __ATOMIC_RELAXED) +
+                    __atomic_load_n(&thread->stats.pushes, __ATOMIC_RELAXED);
+    uint32_t rate = (uint32_t)(reqs - thread->load_reqs);
+
+    thread->load_reqs = reqs;
+    __atomic_store_n(&thread->load, (thread->load * 3 + rate) / 4,
+                     __ATOMIC_RELAXED);
+  }
+}
+
+/*
+ * Rebalancer, once a second after the loads are updated. When the busiest
+ * worker runs more than MigrateThreshold percent above the idlest one it
+ * is asked to hand over a share of its recently active conns, enough to
+ * even the two out if conns were alike, at most MigrateBatch. Then the
+ * loads get MIGRATE_INTERVAL seconds to settle before the next look.
+ */
+void thread_rebalance() {
+  static rel_time_t last;
+  LibeventThread   *hot = NULL, *cold = NULL;
+  uint64_t          want;
+
+  if (!base_conf.migrate_threshold || threads.size() < 2 ||
+      current_time - last < MIGRATE_INTERVAL)
+    return;
+
+  for (size_t i = 0; i < threads.size(); i++) {
+    if (!hot || threads[i]->load > hot->load)
+      hot = threads[i];
+    if (!cold || threads[i]->load < cold->load)
+      cold = threads[i];
+  }
+
+  if (hot == cold || hot->load < MIGRATE_MIN_LOAD ||
+      (uint64_t)hot->load * 100 <=
+      (uint64_t)cold->load * (100 + base_conf.migrate_threshold))
+    return;
+
+  want = (uint64_t)__atomic_load_n(&hot->nconns, __ATOMIC_RELAXED) *
+         (hot->load - cold->load) / (2 * hot->load);
+  if (want > (uint64_t)base_conf.migrate_batch)
+    want = base_conf.migrate_batch;
+  if (want == 0)
+    return;
+
+  dlog1("rebalance: load %u vs %u, moving %d conns\n",
+        hot->load, cold->load, (int)want);
+  last = current_time;
+  hot->migrate_to = cold;
+  __atomic_store_n(&hot->migrate_want, (int)want, __ATOMIC_RELEASE);
+  hot->ring_doorbell();
+}
 
 void dispatch_conn_new(int sfd,
                        enum conn_states init_state,
@@ -224,16 +622,76 @@ void dispatch_conn_new(int sfd,
   if (addr)
     item.addr = *addr;
 
-  int tid = (last_thread + 1) % base_conf.nthreads;
+  int tid = dispatch_pick(&item);
 
   LibeventThread *thread = threads[tid];
-  
-  last_thread = tid;
 
-  thread->cq.push(item);
+  if (!thread->cq.try_push(item)) {
+    dlog4("cq of thread %d is full, drop fd %d\n", tid, sfd);
+    dispatch_thread.stats.cq_full++;
+    close(sfd);
+    return;
+  }
   thread->cq_notify();
 }
 
+/*
+ * Used by listeners owned by a worker (reuseport mode): the accepted
+ * socket stays on the accepting thread, no queue and no wakeup involved.
+ */
+void dispatch_conn_local(LibeventThread *thread,
+                         int sfd,
+                         enum conn_states init_state,
+                         int event_flags,
+                         const struct sockaddr_storage *addr) {
+  cq_item item(sfd, init_state, event_flags);
+
+  if (addr)
+    item.addr = *addr;
+
+  thread->conn_new_from_item(item);
+}
+
+/*
+ * Hands over a burst of accepted sockets. Sockets of a worker owned
+ * listener stay local; otherwise the dispatch policy spreads them and
+ * every worker gets its share with one enqueue and one wakeup.
+ */
+void dispatch_conn_batch(LibeventThread *listener, cq_item *items, int n) {
+  int i;
+
+  if (listener != get_main_thread()) {
+    for (i = 0; i < n; i++)
+      listener->conn_new_from_item(items[i]);
+    return;
+  }
+
+  if (groups.size() != threads.size())
+    groups.resize(threads.size());
+
+  for (i = 0; i < n; i++)
+    groups[dispatch_pick(&items[i])].push_back(items[i]);
+
+  for (i = 0; i < (int)groups.size(); i++) {
+    if (groups[i].empty())
+      continue;
+
+    if (!threads[i]->cq.try_push_batch(&groups[i][0], groups[i].size())) {
+      /* push what still fits one by one, the overflow is refused */
+      for (size_t j = 0; j < groups[i].size(); j++) {
+        if (!threads[i]->cq.try_push(groups[i][j])) {
+          dlog4("cq of thread %d is full, drop fd %d\n", i, groups[i][j].sfd);
+          dispatch_thread.stats.cq_full++;
+          close(groups[i][j].sfd);
+        }
+      }
+    }
+
+    threads[i]->cq_notify();
+    groups[i].clear();
+  }
+}
+
 /*
  * Sets whether or not we accept new connections.
  */
@@ -247,8 +705,17 @@ LibeventThread *get_main_thread() {
   return &dispatch_thread;
 }
 
+/* the LibeventThread whose loop runs on the caller, NULL off the loops */
+LibeventThread *get_current_thread() {
+  return current_thread;
+}
+
 LibeventThread* get_worker_thread(int i) {
   if ((size_t)i < threads.size())
     return threads[i];
   return NULL;
 }
+
+int get_worker_thread_num() {
+  return threads.size();
+}
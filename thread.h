@@ -7,8 +7,12 @@
 #define __PS_THREAD_INCLUDE__
 
 #include <event.h>
+#include <sys/eventfd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
 
 #include "queue.h"
 #include "connection.h"
@@ -20,28 +24,130 @@ struct cq_item {
   cq_item(int fd, enum conn_states state, int evflags) :
     sfd(fd),
     init_state(state),
-    event_flags(evflags)
+    event_flags(evflags),
+    accept_usec(0)
   {
+    addr.ss_family = AF_UNSPEC;  /* peer unknown */
   }
   int               sfd;
   enum conn_states  init_state;
   int               event_flags;
+  uint64_t          accept_usec; /* monotonic time accept() returned */
   struct sockaddr_storage addr;
 };
 
+struct pubsub_topic;
+struct pubsub_msg;
+
+/*
+ * A push for a connection owned by this thread. buf (may be NULL for a
+ * plain flush request) is appended to wbuf by the owner and freed. A
+ * migrate item hands the connection itself over, see conn_migrate().
+ * A publish item has no handle, msg goes to the thread's subscribers of
+ * topic, see pubsub.h.
+ */
+struct push_item {
+  push_item() {}
+
+  push_item(conn_handle_t h, struct evbuffer *b, bool m = false) :
+    handle(h),
+    buf(b),
+    migrate(m),
+    topic(NULL),
+    msg(NULL)
+  {
+  }
+
+  push_item(pubsub_topic *t, pubsub_msg *m) :
+    handle(CONN_HANDLE_NULL),
+    buf(NULL),
+    migrate(false),
+    topic(t),
+    msg(m)
+  {
+  }
+  conn_handle_t     handle;
+  struct evbuffer  *buf;
+  bool              migrate;
+  pubsub_topic     *topic;
+  pubsub_msg       *msg;
+};
+
+/*
+ * Per thread counters, written by the owning thread unless noted and
+ * read without locking by whoever wants to report them.
+ */
+struct thread_stats {
+  uint64_t accepts;             /* connections that ended up on this thread */
+  uint64_t accept_events;       /* listener events handled on this thread */
+  uint64_t accept_lat_usec;     /* sum of accept() -> conn_new latency */
+  uint64_t accept_lat_max_usec; /* worst accept() -> conn_new latency */
+  uint64_t cq_full;             /* sockets closed because cq was full */
+  uint64_t push_q_full;         /* push_q refusals, bumped by producers */
+  uint64_t wakeups_issued;      /* doorbell writes, bumped by producers */
+  uint64_t wakeups_saved;       /* writes skipped, thread was awake */
+  uint64_t push_stale;          /* pushes for connections already gone */
+  uint64_t conn_slabs;          /* conn slabs allocated by this thread */
+  uint64_t conn_slabs_freed;    /* empty slabs given back by this thread */
+  uint64_t conn_cache_refills;  /* freelist refills served by the depot */
+  uint64_t requests;            /* requests parsed on this thread */
+  uint64_t io_syscalls;         /* read/write calls, or io_uring_enter */
+  uint64_t uring_sqes;          /* sqes submitted */
+  uint64_t uring_cqes;          /* cqes reaped */
+  uint64_t epoll_ctls;          /* event_add/event_del, one epoll_ctl each */
+  uint64_t bytes_copied;        /* bytes written the usual way */
+  uint64_t bytes_zerocopy;      /* bytes written with MSG_ZEROCOPY */
+  uint64_t zc_completions;      /* zerocopy sends released by the kernel */
+  uint64_t zc_copied;           /* notifications saying the kernel copied */
+  uint64_t bytes_read;
+  uint64_t read_budget_hits;    /* conns rescheduled with data left unread */
+  uint64_t buffer_shrinks;      /* rbufs compacted after a large transfer */
+  uint64_t buffer_attaches;     /* LazyBuffers: buffers taken by a conn */
+  uint64_t writes_coalesced;    /* responses held back for a later write */
+  uint64_t wbuf_congested;      /* conns crossing the high watermark */
+  uint64_t read_pauses;         /* reads skipped on congested conns */
+  uint64_t push_blocked;        /* pushers made to wait (block policy) */
+  uint64_t push_dropped;        /* pushes refused or dropped, congestion */
+  uint64_t congest_closed;      /* conns closed by the disconnect policy */
+  uint64_t recv_timeouts;       /* conns closed with a request half read */
+  uint64_t send_timeouts;       /* conns closed with output stuck */
+  uint64_t idle_timeouts;
+  uint64_t pushes;              /* pushes appended to a wbuf */
+  uint64_t migrations_out;      /* conns handed to another thread */
+  uint64_t migrations_in;       /* conns taken over from another thread */
+  uint64_t events;              /* readiness events / completions handled */
+  uint64_t spin_hits;           /* BusyPoll: work found spinning idle */
+  uint64_t spin_sleeps;         /* BusyPoll: spins given up for epoll_wait */
+  uint64_t udp_rx;              /* datagrams received */
+  uint64_t udp_tx;              /* datagrams sent */
+  uint64_t udp_dropped;         /* datagrams refused, or not sent */
+  uint64_t publishes;           /* pub/sub messages fanned out here */
+};
+
+class Uring;
+struct conn_zc;
+struct udp_batch;
+
 class LibeventThread : public BaseThread {
 public: 
-  LibeventThread() : _base(NULL) {
+  LibeventThread() :
+    id(-1), uring(NULL), zc_linger(NULL), udp(NULL), scratch(NULL), scratch_size(0),
+    nconns(0), load(0), load_reqs(0), conns(NULL), migrate_to(NULL),
+    migrate_want(0), _base(NULL), _stopping(0), _doorbell_fd(-1), _doorbell_armed(1) {
+    memset(&stats, 0, sizeof(stats));
+    memset(&free_conns, 0, sizeof(free_conns));
   }
 
-  ~LibeventThread() {
-    if (_base)
-      event_base_free(_base);
-  }
-  
+  ~LibeventThread();
+
   bool init();
   bool stop();
 
+  /* true when called from the thread running this event base */
+  bool in_thread() {
+    return pthread_equal(_self, pthread_self());
+  }
+
   struct event_base *get_event_base() {
     return _base; 
   }
@@ -51,60 +157,115 @@ public:
   }
   
   void cq_notify() {
-    /* 
-    if (write(_notify_send_fd, "", 1) != 1) {
-      perror("Writing to thread notify pipe"); 
+    ring_doorbell();
+  }
+
+  bool push_q_notify(const push_item &item) {
+    if (!push_q.try_push(item)) {
+      __sync_fetch_and_add(&stats.push_q_full, 1);
+      return false;
     }
-    */
 
-    int rv, cnt = 0;
-    do {
-      rv = write(_notify_send_fd, "", 1);
-    } while (rv < 0 && errno == EAGAIN && ++cnt < 100);
+    ring_doorbell();
+    return true;
   }
 
-  void push_q_notify(int fd) {
-    push_q.push(fd);
-    /* 
-    if (write(_push_send_fd, "", 1) != 1) {
-      perror("Writing to thread notify pipe"); 
-    } 
-    */
-    
+  /*
+   * Called by producers after they queued work. Only the producer that
+   * finds the doorbell armed (the thread went idle) pays for the write,
+   * everyone else relies on the thread still draining its queues.
+   */
+  void ring_doorbell() {
+    if (!__atomic_exchange_n(&_doorbell_armed, 0, __ATOMIC_SEQ_CST)) {
+      __sync_fetch_and_add(&stats.wakeups_saved, 1);
+      return;
+    }
+
+    uint64_t one = 1;
     int rv, cnt = 0;
     do {
-      rv = write(_push_send_fd, "", 1);
-    } while (rv < 0 && errno == EAGAIN  && ++cnt < 100);
+      rv = write(_doorbell_fd, &one, sizeof(one));
+    } while (rv < 0 && errno == EAGAIN && ++cnt < 100);
+    __sync_fetch_and_add(&stats.wakeups_issued, 1);
   }
 
-  static void thread_libevent_process(int fd, short which, void *arg);
-  static void thread_push_event_process(int fd, short which, void *arg);
+  void conn_new_from_item(const cq_item &item);
+  void push_process(const push_item &item);
+
+  static void thread_doorbell_process(int fd, short which, void *arg);
+  static void thread_timer_process(int fd, short which, void *arg);
 
 public:
-  LockQueue<cq_item> cq;     /* queue of new connections to handle */
-  LockQueue<int>     push_q; /* queue of new push event to handle */
+  int                id;         /* worker index, -1 for the dispatch thread */
+  MpscQueue<cq_item> cq;     /* queue of new connections to handle */
+  MpscQueue<push_item> push_q; /* queue of new push event to handle */
+  thread_stats       stats;
+  conn_cache         free_conns; /* conns ready for reuse on this thread */
+  Uring             *uring;      /* NULL unless EventEngine is io_uring */
+  conn_zc           *zc_linger;  /* zerocopy buffers of closed conns */
+  udp_batch         *udp;        /* datagram sockets, NULL until first read */
+
+  /* LazyBuffers: read area of idle conns, buffers of drained conns */
+  char              *scratch;
+  int                scratch_size;
+  std::vector<struct evbuffer*> rbuf_pool;
+  std::vector<struct evbuffer*> wbuf_pool;
+
+  TimerWheel         timers;     /* conn timeouts, ticks of TimerTick ms */
+
+  /* gauges for dispatch policies, readable from any thread */
+  int                nconns;     /* conns living on this thread */
+  uint32_t           load;       /* requests per second, smoothed */
+  uint64_t           load_reqs;  /* requests + pushes at the last update */
+
+  /* live conns, owner only; linked through conn->next and conn->prev */
+  conn              *conns;
+
+  /* set by the rebalancer: hand migrate_want busy conns to migrate_to */
+  LibeventThread    *migrate_to;
+  int                migrate_want;
 
 protected:
   int do_thread_func();
 
 private:
-  struct event_base *_base;    /* libevent handle this thread uses */
-  struct event _notify_event;  /* listen event for notify pipe */
-  int _notify_receive_fd;      /* receiving end of notify pipe */
-  int _notify_send_fd;         /* sending end of notify pipe */
+  void drain_cq();
+  void drain_push_q();
+  void busy_loop();
 
-  struct event _push_event;  /* listen event for push pipe */
-  int _push_receive_fd;      /* receiving end of push pipe */
-  int _push_send_fd;         /* sending end of push pipe */
+  struct event_base *_base;    /* libevent handle this thread uses */
+  int _stopping;               /* set by stop(), for busy_loop */
+  pthread_t _self;             /* thread running _base */
+  struct event _doorbell_event; /* listen event for the doorbell */
+  struct event _timer_event;   /* drives timers */
+  int _doorbell_fd;            /* eventfd shared by cq and push_q */
+  int _doorbell_armed;         /* 1 when the thread wants to be woken */
 };
 
 void thread_init();
 void thread_stop();
 void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags,
     const struct sockaddr_storage *addr);
+void dispatch_conn_local(LibeventThread *thread, int sfd,
+    enum conn_states init_state, int event_flags,
+    const struct sockaddr_storage *addr);
+void dispatch_conn_batch(LibeventThread *listener, cq_item *items, int n);
+
+/*
+ * Picks the worker index for a new connection. Built in: DispatchPolicy
+ * rr, least_conns, p2c and ip_hash; a server may install its own, it
+ * runs on whatever thread dispatches.
+ */
+typedef int (*dispatch_policy_pt)(const cq_item *item, int nthreads);
+void set_dispatch_policy(dispatch_policy_pt policy);
+int dispatch_conns(int tid);
+void thread_update_load();
+void thread_rebalance();
 void accept_new_conns(bool do_accept);
 
 LibeventThread *get_main_thread();
+LibeventThread *get_current_thread();
 LibeventThread* get_worker_thread(int i);
+int get_worker_thread_num();
 
 #endif /* __PS_THREAD_INCLUDE__ */
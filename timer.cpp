@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) jlijian3@gmail.com
+ */
+
+#include "timer.h"
+
+TimerWheel::TimerWheel() : _now(0), _count(0) {
+  for (int i = 0; i < LEVELS; i++) {
+    for (int j = 0; j < SLOTS; j++) {
+      _slots[i][j].prev = &_slots[i][j];
+      _slots[i][j].next = &_slots[i][j];
+    }
+  }
+}
+
+/* only while the wheel is empty */
+void TimerWheel::init(uint64_t now) {
+  _now = now;
+}
+
+/*
+ * expire is never behind _now here: add() moves past timers to the next
+ * tick, a cascade may bring in timers for the very tick being processed.
+ * A timer goes to the lowest level whose range still covers it relative
+ * to _now: expire and _now agree on every bit above that level. The slot
+ * is cascaded when _now enters the window of expire on that level. Timers
+ * beyond the range of the top level are parked in its farthest slot and
+ * placed again from there.
+ */
+void TimerWheel::link(timer_node *node) {
+  uint64_t    expire = node->expire;
+  timer_node *head;
+  int         level;
+
+  for (level = 0; level < LEVELS - 1; level++) {
+    if (((expire ^ _now) >> (SLOT_BITS * (level + 1))) == 0)
+      break;
+  }
+
+  if (expire - _now >= (uint64_t)1 << (SLOT_BITS * LEVELS))
+    expire = _now + ((uint64_t)1 << (SLOT_BITS * LEVELS)) - 1;
+
+  head = &_slots[level][(expire >> (SLOT_BITS * level)) & SLOT_MASK];
+  node->next = head;
+  node->prev = head->prev;
+  head->prev->next = node;
+  head->prev = node;
+}
+
+void TimerWheel::add(timer_node *node, uint64_t expire) {
+  del(node);
+
+  node->expire = expire;
+  if (node->expire <= _now)
+    node->expire = _now + 1;
+  link(node);
+  _count++;
+}
+
+void TimerWheel::del(timer_node *node) {
+  if (!armed(node))
+    return;
+
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->prev = NULL;
+  node->next = NULL;
+  _count--;
+}
+
+/* places the timers of the current slot of level again, one level down */
+void TimerWheel::cascade(int level) {
+  timer_node *head = &_slots[level][(_now >> (SLOT_BITS * level)) & SLOT_MASK];
+  timer_node *node, *next;
+
+  if (head->next == head)
+    return;
+
+  node = head->next;
+  head->prev->next = NULL;
+  head->prev = head;
+  head->next = head;
+
+  for (; node; node = next) {
+    next = node->next;
+    link(node);
+  }
+}
+
+void TimerWheel::advance(uint64_t now, timer_cb_pt cb, void *arg) {
+  timer_node  expired;
+  timer_node *head, *node;
+
+  while (_now < now) {
+    if (_count == 0) {
+      _now = now;
+      break;
+    }
+
+    _now++;
+
+    for (int level = 1; level < LEVELS; level++) {
+      if ((_now >> (SLOT_BITS * (level - 1))) & SLOT_MASK)
+        break;
+      cascade(level);
+    }
+
+    head = &_slots[0][_now & SLOT_MASK];
+    if (head->next == head)
+      continue;
+
+    /* take the slot over, cb may add timers while we walk it */
+    expired.next = head->next;
+    expired.prev = head->prev;
+    expired.next->prev = &expired;
+    expired.prev->next = &expired;
+    head->next = head;
+    head->prev = head;
+
+    while ((node = expired.next) != &expired) {
+      expired.next = node->next;
+      node->next->prev = &expired;
+      node->prev = NULL;
+      node->next = NULL;
+      _count--;
+
+      if (node->expire <= _now)
+        cb(node, arg);
+      else
+        add(node, node->expire);
+    }
+  }
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) jlijian3@gmail.com
+ */
+
+#ifndef __PS_TIMER_INCLUDE__
+#define __PS_TIMER_INCLUDE__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Embedded in whatever is timed, no allocation per timer. expire is in
+ * ticks of the owning wheel; next is NULL while the node is not armed.
+ */
+struct timer_node {
+  timer_node       *prev;
+  timer_node       *next;
+  uint64_t          expire;
+};
+
+typedef void (*timer_cb_pt)(timer_node *node, void *arg);
+
+/*
+ * Hierarchical timing wheel, 4 levels of 64 slots: level 0 covers the
+ * next 64 ticks one slot per tick, each level above 64 times the range of
+ * the one below. Adding and removing a timer is O(1); a timer moves down
+ * a level at most 3 times before it fires. Not thread safe, every
+ * LibeventThread drives its own.
+ */
+class TimerWheel {
+public:
+  TimerWheel();
+
+  void init(uint64_t now);
+
+  void add(timer_node *node, uint64_t expire);
+  void del(timer_node *node);
+
+  static bool armed(const timer_node *node) {
+    return node->next != NULL;
+  }
+
+  /* moves the wheel to now, cb runs for every timer that expires */
+  void advance(uint64_t now, timer_cb_pt cb, void *arg);
+
+  uint64_t now() const {
+    return _now;
+  }
+
+  size_t size() const {
+    return _count;
+  }
+
+private:
+  enum {
+    LEVELS = 4,
+    SLOT_BITS = 6,
+    SLOTS = 1 << SLOT_BITS,
+    SLOT_MASK = SLOTS - 1
+  };
+
+  void link(timer_node *node);
+  void cascade(int level);
+
+  timer_node        _slots[LEVELS][SLOTS];  /* list heads, circular */
+  uint64_t          _now;                   /* last tick processed */
+  size_t            _count;
+};
+
+#endif /* __PS_TIMER_INCLUDE__ */
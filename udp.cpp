@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) jlijian3@gmail.com
+ */
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "udp.h"
+#include "thread.h"
+#include "log.h"
+
+using namespace std;
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+/* segments the kernel takes in one UDP_SEGMENT send */
+#define UDP_GSO_MAX_SEGS 64
+
+/* the wbuf bytes one request produced, and where they go */
+struct udp_reply {
+  int               msg;     /* receive slot of the request */
+  uint16_t          req_id;
+  size_t            off;
+  size_t            len;
+  size_t            ndgrams;
+};
+
+/*
+ * Per thread, shared by its datagram sockets: the receive slots of one
+ * recvmmsg, and the sendmmsg vectors the replies of a batch go out with.
+ * Replies are framed in place, iovecs point at the headers here and at
+ * wbuf, flattened once per batch.
+ */
+struct udp_batch {
+  int               n;
+  int               slot_size;
+  char             *bufs;
+  struct mmsghdr   *rmsgs;
+  struct iovec     *riov;
+  struct sockaddr_storage *addrs;
+  bool              gso;       /* UDP_SEGMENT, several datagrams a message */
+  vector<udp_reply> replies;
+  vector<uint16_t>  headers;   /* UDP_HEADER_SIZE per datagram sent */
+  vector<struct iovec> iov;
+  vector<struct mmsghdr> smsgs;
+  union {
+    char            buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr  align;
+  } gso_ctrl;
+};
+
+void udp_batch_free(udp_batch *b) {
+  if (!b)
+    return;
+
+  free(b->bufs);
+  free(b->rmsgs);
+  free(b->riov);
+  free(b->addrs);
+  delete b;
+}
+
+static udp_batch *udp_batch_new(int fd) {
+  udp_batch      *b = new udp_batch;
+  struct cmsghdr *cm;
+  int             seg = 0;
+  socklen_t       len = sizeof(seg);
+
+  b->n = base_conf.udp_batch;
+  b->slot_size = base_conf.udp_recv_size;
+  b->bufs = (char *)malloc((size_t)b->n * b->slot_size);
+  b->rmsgs = (struct mmsghdr *)calloc(b->n, sizeof(*b->rmsgs));
+  b->riov = (struct iovec *)calloc(b->n, sizeof(*b->riov));
+  b->addrs = (struct sockaddr_storage *)calloc(b->n, sizeof(*b->addrs));
+  if (!b->bufs || !b->rmsgs || !b->riov || !b->addrs) {
+    udp_batch_free(b);
+    return NULL;
+  }
+
+  for (int i = 0; i < b->n; i++) {
+    b->riov[i].iov_base = b->bufs + (size_t)i * b->slot_size;
+    b->riov[i].iov_len = b->slot_size;
+    b->rmsgs[i].msg_hdr.msg_iov = &b->riov[i];
+    b->rmsgs[i].msg_hdr.msg_iovlen = 1;
+    b->rmsgs[i].msg_hdr.msg_name = &b->addrs[i];
+  }
+
+  /* the option is there since 4.18, older kernels send one by one */
+  b->gso = getsockopt(fd, SOL_UDP, UDP_SEGMENT, &seg, &len) == 0;
+
+  memset(&b->gso_ctrl, 0, sizeof(b->gso_ctrl));
+  cm = &b->gso_ctrl.align;
+  cm->cmsg_level = SOL_UDP;
+  cm->cmsg_type = UDP_SEGMENT;
+  cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+  *(uint16_t *)CMSG_DATA(cm) = (uint16_t)base_conf.udp_payload_max;
+  return b;
+}
+
+/*
+ * Runs the parser over one datagram. The payload is referenced from rbuf,
+ * not copied; it stays valid until the batch has been sent. Whatever the
+ * parser adds to wbuf is the reply, a request left incomplete is dropped.
+ */
+static void udp_request(conn *c, udp_batch *b, int i, parse_request_pt parser) {
+  struct msghdr *mh = &b->rmsgs[i].msg_hdr;
+  const uint8_t *data = (const uint8_t *)b->riov[i].iov_base;
+  size_t         len = b->rmsgs[i].msg_len;
+  size_t         wlen = evbuffer_get_length(c->wbuf);
+  int            nreqs = base_conf.nreqs_per_event;
+  udp_reply      r;
+
+  /* truncated, or a request spread over several datagrams */
+  if ((mh->msg_flags & MSG_TRUNC) || len <= UDP_HEADER_SIZE ||
+      data[4] != 0 || data[5] != 1) {
+    c->thread->stats.udp_dropped++;
+    return;
+  }
+
+  conn_set_peer(c, (const struct sockaddr *)mh->msg_name, mh->msg_namelen);
+  evbuffer_add_reference(c->rbuf, data + UDP_HEADER_SIZE,
+                         len - UDP_HEADER_SIZE, NULL, NULL);
+
+  while (evbuffer_get_length(c->rbuf) > 0 && --nreqs >= 0) {
+    c->parse_to_go = conn_unknown;
+    if (parser(c) != PARSE_OK)
+      break;
+    c->thread->stats.requests++;
+  }
+  evbuffer_drain(c->rbuf, evbuffer_get_length(c->rbuf));
+
+  if (evbuffer_get_length(c->wbuf) == wlen)
+    return;
+
+  r.msg = i;
+  r.req_id = (uint16_t)(data[0] << 8 | data[1]);
+  r.off = wlen;
+  r.len = evbuffer_get_length(c->wbuf) - wlen;
+  r.ndgrams = 0;
+  b->replies.push_back(r);
+}
+
+/*
+ * Sends the replies of a batch. Each datagram is header + up to
+ * UdpPayloadMax - UDP_HEADER_SIZE bytes of the reply. With GSO the
+ * datagrams of a reply share one message and the kernel cuts it, all
+ * segments but the last being exactly UdpPayloadMax long. What does not
+ * fit into the socket buffer is dropped, as UDP does.
+ */
+static void udp_send(conn *c, udp_batch *b) {
+  thread_stats &stats = c->thread->stats;
+  size_t        seg = base_conf.udp_payload_max - UDP_HEADER_SIZE;
+  size_t        per_msg = 1;
+  size_t        ndgrams = 0, nmsgs = 0, d = 0, m = 0, sent = 0;
+  const char   *data;
+
+  if (b->gso) {
+    per_msg = UDP_DGRAM_MAX / base_conf.udp_payload_max;
+    if (per_msg > UDP_GSO_MAX_SEGS)
+      per_msg = UDP_GSO_MAX_SEGS;
+  }
+
+  for (size_t i = 0; i < b->replies.size(); i++) {
+    udp_reply &r = b->replies[i];
+
+    r.ndgrams = (r.len + seg - 1) / seg;
+    if (r.ndgrams > 0xffff) {
+      dlog4("udp reply of %zu bytes is too long\n", r.len);
+      stats.udp_dropped++;
+      r.ndgrams = 0;
+    }
+    ndgrams += r.ndgrams;
+    nmsgs += (r.ndgrams + per_msg - 1) / per_msg;
+  }
+
+  b->headers.resize(ndgrams * UDP_HEADER_SIZE / sizeof(uint16_t));
+  b->iov.resize(ndgrams * 2);
+  b->smsgs.resize(nmsgs);
+  data = (const char *)evbuffer_pullup(c->wbuf, -1);
+
+  for (size_t i = 0; i < b->replies.size(); i++) {
+    udp_reply     &r = b->replies[i];
+    struct msghdr *rmh = &b->rmsgs[r.msg].msg_hdr;
+
+    for (size_t k = 0; k < r.ndgrams; k += per_msg) {
+      struct msghdr *mh = &b->smsgs[m++].msg_hdr;
+      size_t         cnt = r.ndgrams - k < per_msg ? r.ndgrams - k : per_msg;
+
+      mh->msg_name = rmh->msg_name;
+      mh->msg_namelen = rmh->msg_namelen;
+      mh->msg_iov = &b->iov[d * 2];
+      mh->msg_iovlen = cnt * 2;
+      mh->msg_control = cnt > 1 ? b->gso_ctrl.buf : NULL;
+      mh->msg_controllen = cnt > 1 ? CMSG_SPACE(sizeof(uint16_t)) : 0;
+      mh->msg_flags = 0;
+
+      for (size_t j = k; j < k + cnt; j++, d++) {
+        uint16_t *h = &b->headers[d * UDP_HEADER_SIZE / sizeof(uint16_t)];
+        size_t    off = j * seg;
+
+        h[0] = htons(r.req_id);
+        h[1] = htons((uint16_t)j);
+        h[2] = htons((uint16_t)r.ndgrams);
+        h[3] = 0;
+        b->iov[d * 2].iov_base = h;
+        b->iov[d * 2].iov_len = UDP_HEADER_SIZE;
+        b->iov[d * 2 + 1].iov_base = (void *)(data + r.off + off);
+        b->iov[d * 2 + 1].iov_len = r.len - off < seg ? r.len - off : seg;
+      }
+    }
+  }
+
+  while (sent < nmsgs) {
+    size_t cnt = nmsgs - sent < UDP_MAX_BATCH ? nmsgs - sent : UDP_MAX_BATCH;
+    int    rv = sendmmsg(c->fd, &b->smsgs[sent], cnt, MSG_DONTWAIT);
+
+    stats.io_syscalls++;
+    if (rv < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EIO && b->gso) {
+        /* no checksum offload on the way out, the kernel can't segment */
+        dlog1("udp fd:%d GSO refused, sending datagrams one by one\n", c->fd);
+        b->gso = false;
+      } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+        perror("sendmmsg()");
+      }
+      break;
+    }
+    for (int i = 0; i < rv; i++)
+      stats.udp_tx += b->smsgs[sent + i].msg_hdr.msg_iovlen / 2;
+    sent += rv;
+  }
+
+  for (; sent < nmsgs; sent++)
+    stats.udp_dropped += b->smsgs[sent].msg_hdr.msg_iovlen / 2;
+}
+
+/*
+ * Read event of a datagram socket: one recvmmsg of up to UdpBatch
+ * requests, parsed in turn on the socket's conn with the peer set to the
+ * sender, then one sendmmsg for all the replies. The socket is
+ * level-triggered, anything left queued brings us back.
+ */
+void udp_process(conn *c, parse_request_pt parser) {
+  LibeventThread *thread = c->thread;
+  udp_batch      *b = thread->udp;
+  int             n;
+
+  if (!b && !(b = thread->udp = udp_batch_new(c->fd))) {
+    dlog1("Can't allocate udp batch\n");
+    return;
+  }
+
+  if (!conn_buffers_attach(c))
+    return;
+
+  for (int i = 0; i < b->n; i++)
+    b->rmsgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+
+  n = recvmmsg(c->fd, b->rmsgs, b->n, MSG_DONTWAIT, NULL);
+  thread->stats.io_syscalls++;
+  if (n <= 0) {
+    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      perror("recvmmsg()");
+    return;
+  }
+  thread->stats.udp_rx += n;
+
+  b->replies.clear();
+  for (int i = 0; i < n; i++)
+    udp_request(c, b, i, parser);
+
+  if (!b->replies.empty())
+    udp_send(c, b);
+  evbuffer_drain(c->wbuf, evbuffer_get_length(c->wbuf));
+}
@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) jlijian3@gmail.com
+ */
+
+#ifndef __PS_UDP_INCLUDE__
+#define __PS_UDP_INCLUDE__
+
+#include "connection.h"
+
+/*
+ * Every datagram, both ways, starts with the memcached UDP frame header,
+ * 16 bit fields in network order: request id, sequence number, number of
+ * datagrams in the message, reserved (0). Requests are one datagram, a
+ * response longer than UdpPayloadMax is split into a numbered sequence
+ * carrying the request id of the request.
+ */
+#define UDP_HEADER_SIZE  8
+#define UDP_MAX_BATCH    1024   /* UIO_MAXIOV, the most sendmmsg takes */
+#define UDP_DGRAM_MAX    65507  /* largest payload of an ipv4 datagram */
+
+struct udp_batch;
+
+void udp_process(conn *c, parse_request_pt parser);
+void udp_batch_free(struct udp_batch *b);
+
+#endif /* __PS_UDP_INCLUDE__ */
@@ -0,0 +1,721 @@
+/*
+ * Copyright (C) jlijian3@gmail.com
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "uring.h"
+#include "thread.h"
+#include "util.h"
+#include "log.h"
+
+using namespace std;
+
+enum uring_op {
+  URING_OP_ACCEPT = 1,
+  URING_OP_RECV,
+  URING_OP_SEND,
+  URING_OP_POLL,
+  URING_OP_CANCEL
+};
+
+/*
+ * user_data layout: op in the top 4 bits, the low 28 bits of the handle
+ * generation, then the fd. Completions for a conn that has been closed
+ * (or whose fd has been reused) no longer match and are dropped.
+ */
+static inline uint64_t make_ud(int op, const conn *c) {
+  return ((uint64_t)op << 60) |
+         ((uint64_t)(CONN_HANDLE_GEN(c->handle) & 0x0fffffff) << 32) |
+         (uint32_t)c->fd;
+}
+
+static inline int ud_op(uint64_t ud) {
+  return (int)(ud >> 60);
+}
+
+static inline conn *ud_conn(uint64_t ud) {
+  conn *c = conn_from_fd((int)(ud & 0xffffffff));
+
+  if (!c || !c->uio ||
+      (CONN_HANDLE_GEN(c->handle) & 0x0fffffff) != ((ud >> 32) & 0x0fffffff))
+    return NULL;
+  return c;
+}
+
+bool Uring::available() {
+#ifdef __NR_io_uring_setup
+  return true;
+#else
+  return false;
+#endif
+}
+
+Uring::Uring(LibeventThread *thread) :
+  _thread(thread),
+  _ring_fd(-1),
+  _event_fd(-1),
+  _sq_ptr(MAP_FAILED),
+  _sq_len(0),
+  _cq_ptr(MAP_FAILED),
+  _cq_len(0),
+  _sqes((struct io_uring_sqe *)MAP_FAILED),
+  _sqes_len(0),
+  _sqe_tail(0),
+  _buf_ring((struct io_uring_buf_ring *)MAP_FAILED),
+  _buf_ring_len(0),
+  _bufs(NULL),
+  _nbufs(0),
+  _bufsize(0),
+  _in_process(false),
+  _flush_pending(false),
+  _orphans(NULL)
+{
+  pthread_mutex_init(&_remote_lock, NULL);
+}
+
+Uring::~Uring() {
+  while (_orphans) {
+    uring_io *uio = _orphans;
+    _orphans = uio->next;
+    evbuffer_free(uio->sendbuf);
+    free(uio);
+  }
+
+  if (_event_fd >= 0) {
+    event_del(&_event);
+    close(_event_fd);
+  }
+  if (_ring_fd >= 0)
+    close(_ring_fd);
+  if (_buf_ring != MAP_FAILED)
+    munmap(_buf_ring, _buf_ring_len);
+  if (_sqes != MAP_FAILED)
+    munmap(_sqes, _sqes_len);
+  if (_cq_ptr != MAP_FAILED && _cq_ptr != _sq_ptr)
+    munmap(_cq_ptr, _cq_len);
+  if (_sq_ptr != MAP_FAILED)
+    munmap(_sq_ptr, _sq_len);
+  free(_bufs);
+  pthread_mutex_destroy(&_remote_lock);
+}
+
+bool Uring::init(unsigned entries, unsigned nbufs, unsigned bufsize) {
+#ifdef __NR_io_uring_setup
+  struct io_uring_params  p;
+  struct io_uring_buf_reg reg;
+  unsigned                n;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CLAMP;
+
+  _ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (_ring_fd < 0) {
+    perror("io_uring_setup");
+    return false;
+  }
+
+  _sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  _cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (_cq_len > _sq_len)
+      _sq_len = _cq_len;
+    _cq_len = _sq_len;
+  }
+
+  _sq_ptr = mmap(0, _sq_len, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+  if (_sq_ptr == MAP_FAILED) {
+    perror("io_uring mmap sq");
+    return false;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    _cq_ptr = _sq_ptr;
+  } else {
+    _cq_ptr = mmap(0, _cq_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+    if (_cq_ptr == MAP_FAILED) {
+      perror("io_uring mmap cq");
+      return false;
+    }
+  }
+
+  _sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  _sqes = (struct io_uring_sqe *)mmap(0, _sqes_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES);
+  if (_sqes == MAP_FAILED) {
+    perror("io_uring mmap sqes");
+    return false;
+  }
+
+  _sq_head = (unsigned *)((char *)_sq_ptr + p.sq_off.head);
+  _sq_tail = (unsigned *)((char *)_sq_ptr + p.sq_off.tail);
+  _sq_mask = *(unsigned *)((char *)_sq_ptr + p.sq_off.ring_mask);
+  _sq_entries = *(unsigned *)((char *)_sq_ptr + p.sq_off.ring_entries);
+  _sq_array = (unsigned *)((char *)_sq_ptr + p.sq_off.array);
+  _cq_head = (unsigned *)((char *)_cq_ptr + p.cq_off.head);
+  _cq_tail = (unsigned *)((char *)_cq_ptr + p.cq_off.tail);
+  _cq_mask = *(unsigned *)((char *)_cq_ptr + p.cq_off.ring_mask);
+  _cqes = (struct io_uring_cqe *)((char *)_cq_ptr + p.cq_off.cqes);
+
+  /* sqe i always sits in sq slot i */
+  for (n = 0; n < _sq_entries; n++)
+    _sq_array[n] = n;
+  _sqe_tail = *_sq_tail;
+
+  /* provided buffer ring for multishot recv, group 0 */
+  for (n = 1; n < nbufs && n < 32768; n <<= 1)
+    ;
+  _nbufs = n;
+  _bufsize = bufsize;
+  _buf_ring_len = _nbufs * sizeof(struct io_uring_buf);
+  _buf_ring = (struct io_uring_buf_ring *)mmap(0, _buf_ring_len,
+      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (_buf_ring == MAP_FAILED) {
+    perror("io_uring mmap buf ring");
+    return false;
+  }
+
+  if (posix_memalign((void **)&_bufs, 4096, (size_t)_nbufs * _bufsize) != 0) {
+    _bufs = NULL;
+    perror("io_uring buffers");
+    return false;
+  }
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long)_buf_ring;
+  reg.ring_entries = _nbufs;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, _ring_fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) != 0) {
+    perror("io_uring register buffer ring");
+    return false;
+  }
+
+  _buf_ring->tail = 0;
+  for (n = 0; n < _nbufs; n++)
+    recycle_buf(n);
+
+  /* completions wake the libevent loop through an eventfd */
+  _event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_event_fd < 0) {
+    perror("io_uring eventfd");
+    return false;
+  }
+
+  if (syscall(__NR_io_uring_register, _ring_fd, IORING_REGISTER_EVENTFD,
+              &_event_fd, 1) != 0) {
+    perror("io_uring register eventfd");
+    close(_event_fd);
+    _event_fd = -1;
+    return false;
+  }
+
+  event_set(&_event, _event_fd, EV_READ | EV_PERSIST, event_process, this);
+  event_base_set(_thread->get_event_base(), &_event);
+  if (event_add(&_event, 0) == -1) {
+    dlog4("Can't monitor io_uring eventfd\n");
+    close(_event_fd);
+    _event_fd = -1;
+    return false;
+  }
+
+  event_set(&_flush_event, -1, 0, flush_process, this);
+  event_base_set(_thread->get_event_base(), &_flush_event);
+  return true;
+#else
+  return false;
+#endif
+}
+
+/*
+ * The entries are addressed by hand: in C++ the flexible bufs[] member of
+ * io_uring_buf_ring does not start at offset 0 as the kernel expects.
+ */
+void Uring::recycle_buf(unsigned bid) {
+  unsigned short       tail = _buf_ring->tail;
+  struct io_uring_buf *buf = (struct io_uring_buf *)_buf_ring +
+                             (tail & (_nbufs - 1));
+
+  buf->addr = (unsigned long)(_bufs + (size_t)bid * _bufsize);
+  buf->len = _bufsize;
+  buf->bid = bid;
+  __atomic_store_n(&_buf_ring->tail, (unsigned short)(tail + 1),
+                   __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe *Uring::get_sqe() {
+  struct io_uring_sqe *sqe;
+
+  if (_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries) {
+    flush();
+    if (_sqe_tail - __atomic_load_n(_sq_head, __ATOMIC_ACQUIRE) >= _sq_entries)
+      return NULL;
+  }
+
+  sqe = &_sqes[_sqe_tail & _sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/*
+ * Sqes queued while completions are processed go out together at the end
+ * of process(); anything queued from other callbacks is flushed once,
+ * after the callbacks of the current loop iteration.
+ */
+void Uring::queue_sqe_done() {
+  _sqe_tail++;
+
+  if (!_in_process && !_flush_pending) {
+    _flush_pending = true;
+    event_active(&_flush_event, EV_WRITE, 0);
+  }
+}
+
+void Uring::flush() {
+  unsigned n = _sqe_tail - *_sq_tail;
+  int      rv;
+
+  if (n == 0)
+    return;
+
+  __atomic_store_n(_sq_tail, _sqe_tail, __ATOMIC_RELEASE);
+
+  do {
+    rv = syscall(__NR_io_uring_enter, _ring_fd, n, 0, 0, NULL, 0);
+  } while (rv < 0 && errno == EINTR);
+
+  if (rv < 0)
+    perror("io_uring_enter");
+
+  _thread->stats.io_syscalls++;
+  _thread->stats.uring_sqes += n;
+}
+
+bool Uring::arm_accept(conn *c) {
+  struct io_uring_sqe *sqe = get_sqe();
+
+  if (!sqe)
+    return false;
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = c->fd;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = make_ud(URING_OP_ACCEPT, c);
+  c->uio->accept_armed = 1;
+  queue_sqe_done();
+  return true;
+}
+
+bool Uring::arm_pollout(conn *c) {
+  struct io_uring_sqe *sqe = get_sqe();
+
+  if (!sqe)
+    return false;
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = c->fd;
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data = make_ud(URING_OP_POLL, c);
+  c->uio->poll_armed = 1;
+  queue_sqe_done();
+  return true;
+}
+
+bool Uring::arm_recv(conn *c) {
+  struct io_uring_sqe *sqe = get_sqe();
+
+  if (!sqe)
+    return false;
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = c->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = make_ud(URING_OP_RECV, c);
+  c->uio->recv_armed = 1;
+  queue_sqe_done();
+  return true;
+}
+
+void Uring::cancel(uint64_t ud) {
+  struct io_uring_sqe *sqe = get_sqe();
+
+  if (!sqe)
+    return;
+
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = -1;
+  sqe->addr = ud;
+  sqe->user_data = (uint64_t)URING_OP_CANCEL << 60;
+  queue_sqe_done();
+}
+
+/*
+ * Called by conn_new on the owning thread. Listeners created by the main
+ * thread for a worker (reuseport mode) are armed later by the worker.
+ */
+bool Uring::start(conn *c) {
+  if (!c->uio) {
+    if (!(c->uio = (uring_io *)calloc(1, sizeof(uring_io))))
+      return false;
+    if (!(c->uio->sendbuf = evbuffer_new())) {
+      free(c->uio);
+      c->uio = NULL;
+      return false;
+    }
+  } else {
+    evbuffer_drain(c->uio->sendbuf, evbuffer_get_length(c->uio->sendbuf));
+    c->uio->recv_unread = 0;
+    c->uio->accept_armed = 0;
+    c->uio->recv_armed = 0;
+    c->uio->recv_cancel = 0;
+    c->uio->send_inflight = 0;
+    c->uio->send_error = 0;
+    c->uio->eof = 0;
+    c->uio->poll_armed = 0;
+  }
+
+  sync(c);
+  return true;
+}
+
+/* brings the multishot operations of c in line with c->ev_flags */
+void Uring::sync(conn *c) {
+  if (!_thread->in_thread()) {
+    pthread_mutex_lock(&_remote_lock);
+    _remote.push_back(c->handle);
+    pthread_mutex_unlock(&_remote_lock);
+    event_active(&_flush_event, EV_WRITE, 0);
+    return;
+  }
+
+  apply(c);
+}
+
+void Uring::apply(conn *c) {
+  uring_io *uio = c->uio;
+
+  if (c->state == conn_listening) {
+    if (c->ev_flags && !uio->accept_armed)
+      arm_accept(c);
+    else if (!c->ev_flags && uio->accept_armed)
+      cancel(make_ud(URING_OP_ACCEPT, c));
+    return;
+  }
+
+  /*
+   * Multishot recv keeps filling rbuf on its own: it is cancelled while
+   * output is congested or the state machine is a read budget behind,
+   * and armed again once both are over.
+   */
+  if (c->congest_usec || uio->recv_unread >= (size_t)base_conf.read_budget) {
+    if (uio->recv_armed && !uio->recv_cancel) {
+      cancel(make_ud(URING_OP_RECV, c));
+      uio->recv_cancel = 1;
+    }
+    return;
+  }
+
+  if (!uio->recv_armed && !uio->eof)
+    arm_recv(c);
+}
+
+void Uring::conn_closed(conn *c) {
+  uring_io *uio = c->uio;
+
+  if (!uio)
+    return;
+
+  if (uio->accept_armed)
+    cancel(make_ud(URING_OP_ACCEPT, c));
+  if (uio->recv_armed)
+    cancel(make_ud(URING_OP_RECV, c));
+  if (uio->poll_armed)
+    cancel(make_ud(URING_OP_POLL, c));
+
+  if (uio->send_inflight) {
+    /* the kernel still reads sendbuf, keep it until the completion */
+    cancel(uio->send_ud);
+    uio->next = _orphans;
+    _orphans = uio;
+    c->uio = NULL;
+  }
+}
+
+/*
+ * Moves wbuf into sendbuf and submits one sendmsg for it. The result
+ * comes back through the state machine once the completion is reaped.
+ */
+enum write_buf_result Uring::send(conn *c) {
+  uring_io            *uio = c->uio;
+  struct io_uring_sqe *sqe;
+  int                  n;
+
+  if (uio->send_error) {
+    c->error = conn_wr_err;
+    return WRITE_HARD_ERROR;
+  }
+
+  if (uio->send_inflight || uio->poll_armed)
+    return WRITE_SOFT_ERROR;
+
+  if (evbuffer_get_length(uio->sendbuf) == 0) {
+    if (!c->wbuf || evbuffer_get_length(c->wbuf) == 0)
+      return WRITE_COMPLETE;
+    if (c->wfiles)
+      return send_file(c);
+    evbuffer_add_buffer(uio->sendbuf, c->wbuf);
+  }
+
+  if (!(sqe = get_sqe())) {
+    c->error = conn_wr_err;
+    return WRITE_HARD_ERROR;
+  }
+
+  n = evbuffer_peek(uio->sendbuf, -1, NULL, uio->iov, URING_MAX_IOV);
+  if (n > URING_MAX_IOV)
+    n = URING_MAX_IOV;
+
+  memset(&uio->msg, 0, sizeof(uio->msg));
+  uio->msg.msg_iov = uio->iov;
+  uio->msg.msg_iovlen = n;
+
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = c->fd;
+  sqe->addr = (unsigned long)&uio->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = make_ud(URING_OP_SEND, c);
+
+  uio->send_ud = sqe->user_data;
+  uio->send_inflight = 1;
+  queue_sqe_done();
+  return WRITE_SOFT_ERROR;
+}
+
+/*
+ * wbuf holds file segments (conn_add_file): nothing is in flight, so
+ * write it synchronously, sendfile included, and poll for POLLOUT when
+ * the socket is full.
+ */
+enum write_buf_result Uring::send_file(conn *c) {
+  int wsize = evbuffer_get_length(c->wbuf);
+  int nwrite = evbuffer_write(c->wbuf, c->fd);
+
+  _thread->stats.io_syscalls++;
+
+  if (nwrite > 0) {
+    _thread->stats.bytes_copied += nwrite;
+    return nwrite < wsize ? WRITE_INCOMPLETE : WRITE_COMPLETE;
+  }
+
+  /* libevent reports a sendfile EAGAIN as 0 */
+  if (nwrite == 0 ||
+      (nwrite == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+    if (arm_pollout(c))
+      return WRITE_SOFT_ERROR;
+  }
+
+  c->error = conn_wr_err;
+  return WRITE_HARD_ERROR;
+}
+
+void Uring::handle_cqe(struct io_uring_cqe *cqe) {
+  uint64_t  ud = cqe->user_data;
+  int       res = cqe->res;
+  bool      more = cqe->flags & IORING_CQE_F_MORE;
+  conn     *c = NULL;
+  uring_io *uio = NULL;
+
+  if (ud_op(ud) != URING_OP_CANCEL && (c = ud_conn(ud)))
+    uio = c->uio;
+
+  switch (ud_op(ud)) {
+  case URING_OP_ACCEPT:
+    if (!c) {
+      if (res >= 0)
+        close(res);
+      break;
+    }
+
+    if (!more)
+      uio->accept_armed = 0;
+
+    if (res >= 0) {
+      if (conn_fd_map_size() + _accepted.size() >
+          (size_t)base_conf.max_conns) {
+        dlog4("Too many open connections:%d\n", base_conf.max_conns);
+        close(res);
+        conn_listen_pause();
+      } else {
+        cq_item   item(res, conn_new_req, EV_READ | EV_PERSIST);
+        socklen_t len = sizeof(item.addr);
+
+        item.accept_usec = Util::MonoUsec();
+        item.addr.ss_family = AF_UNSPEC;
+        /* multishot accept has no address, ip_hash can't go without one */
+        if (base_conf.dispatch_policy == DISPATCH_IP_HASH &&
+            getpeername(res, (struct sockaddr *)&item.addr, &len) != 0)
+          item.addr.ss_family = AF_UNSPEC;
+        _accepted.push_back(item);
+      }
+    } else if (res == -EMFILE || res == -ENFILE) {
+      dlog4("Too many open connections\n");
+      conn_listen_pause();
+    } else if (res != -ECANCELED) {
+      errno = -res;
+      perror("io_uring accept");
+    }
+
+    if (!uio->accept_armed && c->ev_flags)
+      _rearm.push_back(c->handle);
+    break;
+
+  case URING_OP_RECV:
+    if (c) {
+      if (res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (conn_buffers_attach(c))
+          evbuffer_add(c->rbuf, _bufs + (size_t)bid * _bufsize, res);
+        uio->recv_unread += res;
+        if (more && uio->recv_unread >= (size_t)base_conf.read_budget)
+          apply(c);
+      } else if (res == 0) {
+        uio->eof = 1;
+        c->error = conn_reset_by_peer;
+      } else if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+        uio->eof = 1;
+        c->error = conn_rd_err;
+      }
+
+      if (!more) {
+        uio->recv_armed = 0;
+        uio->recv_cancel = 0;
+        if (!uio->eof)
+          _rearm.push_back(c->handle);
+      }
+    }
+
+    if (cqe->flags & IORING_CQE_F_BUFFER)
+      recycle_buf(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+    if (c && (res > 0 || uio->eof))
+      conn_io_ready(c, EV_READ);
+    break;
+
+  case URING_OP_SEND:
+    if (c && uio->send_inflight && uio->send_ud == ud) {
+      uio->send_inflight = 0;
+      if (res > 0) {
+        evbuffer_drain(uio->sendbuf, res);
+        _thread->stats.bytes_copied += res;
+        c->write_tick = _thread->timers.now();
+      }
+      else if (res != -EAGAIN && res != -EINTR)
+        uio->send_error = 1;
+      conn_io_ready(c, EV_WRITE);
+      break;
+    }
+
+    for (uring_io **p = &_orphans; *p; p = &(*p)->next) {
+      if ((*p)->send_ud == ud) {
+        uring_io *o = *p;
+        *p = o->next;
+        evbuffer_free(o->sendbuf);
+        free(o);
+        break;
+      }
+    }
+    break;
+
+  case URING_OP_POLL:
+    if (c && uio->poll_armed) {
+      uio->poll_armed = 0;
+      conn_io_ready(c, EV_WRITE);
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+void Uring::process() {
+  vector<conn_handle_t> remote;
+  unsigned              head, tail;
+  uint64_t              count;
+
+  if (read(_event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    perror("read io_uring eventfd");
+
+  _in_process = true;
+
+  while (1) {
+    head = *_cq_head;
+    tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+      break;
+
+    for (; head != tail; head++) {
+      handle_cqe(&_cqes[head & _cq_mask]);
+      _thread->stats.uring_cqes++;
+    }
+    __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  if (!_accepted.empty()) {
+    dispatch_conn_batch(_thread, &_accepted[0], _accepted.size());
+    _accepted.clear();
+  }
+
+  pthread_mutex_lock(&_remote_lock);
+  remote.swap(_remote);
+  pthread_mutex_unlock(&_remote_lock);
+  _rearm.insert(_rearm.end(), remote.begin(), remote.end());
+
+  for (size_t i = 0; i < _rearm.size(); i++) {
+    conn *c = conn_from_handle(_rearm[i]);
+    if (c && c->uio)
+      apply(c);
+  }
+  _rearm.clear();
+
+  _in_process = false;
+  flush();
+}
+
+void Uring::event_process(int fd, short which, void *arg) {
+  ((Uring *)arg)->process();
+}
+
+void Uring::flush_process(int fd, short which, void *arg) {
+  Uring *me = (Uring *)arg;
+  vector<conn_handle_t> remote;
+
+  me->_flush_pending = false;
+
+  pthread_mutex_lock(&me->_remote_lock);
+  remote.swap(me->_remote);
+  pthread_mutex_unlock(&me->_remote_lock);
+
+  for (size_t i = 0; i < remote.size(); i++) {
+    conn *c = conn_from_handle(remote[i]);
+    if (c && c->uio)
+      me->apply(c);
+  }
+
+  me->flush();
+}
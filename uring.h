@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) jlijian3@gmail.com
+ */
+
+#ifndef __PS_URING_INCLUDE__
+#define __PS_URING_INCLUDE__
+
+#include <event.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <vector>
+
+#include "connection.h"
+
+#define URING_MAX_IOV 16
+
+class LibeventThread;
+struct cq_item;
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct io_uring_buf_ring;
+
+/*
+ * io_uring state of a connection, allocated the first time a conn runs on
+ * an io_uring thread and kept with the conn afterwards. While a send is
+ * in flight the kernel owns sendbuf, msg and iov; a conn closed at that
+ * point leaves its uring_io behind until the completion shows up.
+ */
+struct uring_io {
+  struct evbuffer  *sendbuf;   /* bytes handed to the kernel */
+  struct msghdr     msg;
+  struct iovec      iov[URING_MAX_IOV];
+  uint64_t          send_ud;   /* user_data of the send in flight */
+  size_t            recv_unread; /* received since the state machine read */
+  unsigned          accept_armed:1;
+  unsigned          recv_armed:1;
+  unsigned          recv_cancel:1; /* cancel of the recv submitted */
+  unsigned          send_inflight:1;
+  unsigned          send_error:1;
+  unsigned          eof:1;
+  unsigned          poll_armed:1;  /* waiting for POLLOUT, file send */
+  uring_io         *next;      /* orphan list */
+};
+
+/*
+ * Per thread io_uring engine. It lives inside the thread's libevent loop:
+ * completions are signalled through an eventfd registered with the ring,
+ * so timers, the doorbell and plain libevent connections keep working.
+ * Listeners use multishot accept, connections multishot recv into a
+ * provided buffer ring, sends are queued and submitted once per loop
+ * iteration.
+ */
+class Uring {
+public:
+  Uring(LibeventThread *thread);
+  ~Uring();
+
+  bool init(unsigned entries, unsigned nbufs, unsigned bufsize);
+
+  bool start(conn *c);
+  void sync(conn *c);
+  void conn_closed(conn *c);
+  enum write_buf_result send(conn *c);
+
+  static bool available();
+
+private:
+  struct io_uring_sqe *get_sqe();
+  void queue_sqe_done();
+  void flush();
+  void apply(conn *c);
+  bool arm_accept(conn *c);
+  bool arm_recv(conn *c);
+  bool arm_pollout(conn *c);
+  enum write_buf_result send_file(conn *c);
+  void cancel(uint64_t ud);
+  void handle_cqe(struct io_uring_cqe *cqe);
+  void recycle_buf(unsigned bid);
+  void process();
+
+  static void event_process(int fd, short which, void *arg);
+  static void flush_process(int fd, short which, void *arg);
+
+  LibeventThread      *_thread;
+  int                  _ring_fd;
+  int                  _event_fd;
+
+  void                *_sq_ptr;
+  size_t               _sq_len;
+  void                *_cq_ptr;
+  size_t               _cq_len;
+  struct io_uring_sqe *_sqes;
+  size_t               _sqes_len;
+  unsigned            *_sq_head;
+  unsigned            *_sq_tail;
+  unsigned            *_sq_array;
+  unsigned             _sq_mask;
+  unsigned             _sq_entries;
+  unsigned             _sqe_tail;   /* next sqe to fill, published by flush */
+  unsigned            *_cq_head;
+  unsigned            *_cq_tail;
+  unsigned             _cq_mask;
+  struct io_uring_cqe *_cqes;
+
+  struct io_uring_buf_ring *_buf_ring;
+  size_t               _buf_ring_len;
+  char                *_bufs;
+  unsigned             _nbufs;
+  unsigned             _bufsize;
+
+  struct event         _event;
+  struct event         _flush_event;
+  bool                 _in_process;
+  bool                 _flush_pending;
+
+  std::vector<conn_handle_t> _rearm;   /* multishot ops to re-arm */
+  std::vector<cq_item>       _accepted;
+  uring_io            *_orphans;
+
+  pthread_mutex_t      _remote_lock;   /* listeners updated off-thread */
+  std::vector<conn_handle_t> _remote;
+};
+
+#endif /* __PS_URING_INCLUDE__ */
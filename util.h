@@ -35,14 +35,27 @@ public:
 		return ToString(ExecTime(beg, end));
 	}
 
+	// monotonic clock in microseconds, for measuring intervals
+	static uint64_t MonoUsec()
+	{
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+
 	// ȡ???ڴ?
+	// formatted once a second per thread, servers have current_log_date()
 	static string GetDate()
 	{
+		static __thread time_t	lasttime;
+		static __thread char	st[20];
 		time_t		nowtime;
 		struct tm	res;
-		char st[20];
 
 		time(&nowtime);
+		if (nowtime == lasttime)
+			return st;
+
 		localtime_r(&nowtime, &res);
 		sprintf(st, "%04d-%02d-%02d %02d:%02d:%02d",
 			res.tm_year+1900,
@@ -51,6 +64,7 @@ public:
 			res.tm_hour,
 			res.tm_min,
 			res.tm_sec);
+		lasttime = nowtime;
 		return st;
 	}
 